@@ -0,0 +1,144 @@
+//
+// Check that the tile loops of the matching and of the assembly do not allocate: the heap allocations of a view may
+// only depend on the view, not on how many tiles it has. The whole-view modes allocate their arrays over the tiles
+// once per view or target view, and the integral mode one summed-area table per shift it evaluates, which depends on
+// how far the matches are and is counted apart.
+//
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include "integral_costs.h"
+#include "patchmatch.h"
+#include "scratch_arena.h"
+#include "synthetic.h"
+
+using namespace std;
+
+// every operator new of the program goes through here
+atomic<size_t> heap_allocations(0);
+
+void *operator new(size_t size) {
+    heap_allocations.fetch_add(1, memory_order_relaxed);
+    if (void *pointer = malloc(size ? size : 1)) {
+        return pointer;
+    }
+    throw bad_alloc();
+}
+
+void *operator new(size_t size, align_val_t alignment) {
+    heap_allocations.fetch_add(1, memory_order_relaxed);
+    size_t bytes = (size + (size_t) alignment - 1) / (size_t) alignment * (size_t) alignment;
+    if (void *pointer = aligned_alloc((size_t) alignment, bytes ? bytes : (size_t) alignment)) {
+        return pointer;
+    }
+    throw bad_alloc();
+}
+
+// the one function giving memory back. It is kept out of line, so that the compiler does not see a free of a pointer
+// returned by operator new once the deletes are inlined (-Wmismatched-new-delete)
+__attribute__((noinline)) void release(void *pointer) noexcept {
+    free(pointer);
+}
+
+void operator delete(void *pointer) noexcept {
+    release(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+    release(pointer);
+}
+
+void operator delete(void *pointer, align_val_t) noexcept {
+    release(pointer);
+}
+
+void operator delete(void *pointer, size_t, align_val_t) noexcept {
+    release(pointer);
+}
+
+// the array forms, so that new[] and delete[] pair with the functions above rather than with those of the library
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void *operator new[](size_t size, align_val_t alignment) {
+    return operator new(size, alignment);
+}
+
+void operator delete[](void *pointer) noexcept {
+    release(pointer);
+}
+
+void operator delete[](void *pointer, size_t) noexcept {
+    release(pointer);
+}
+
+void operator delete[](void *pointer, align_val_t) noexcept {
+    release(pointer);
+}
+
+void operator delete[](void *pointer, size_t, align_val_t) noexcept {
+    release(pointer);
+}
+
+size_t view_allocations(const PatchMatchEngine &engine, const LightFieldView &scene) {
+    // heap allocations made while matching and assembling the centre view, other than the summed-area tables
+    size_t before = heap_allocations.load() - IntegralCosts::allocated_tables();
+    {
+        Frankenpatches patches = engine.frankenpatches(scene, scene.grid_rows / 2, scene.grid_cols / 2);
+    }
+    return heap_allocations.load() - IntegralCosts::allocated_tables() - before;
+}
+
+int main(int argc, char **argv) {
+    int patch_size = argc > 1 ? stoi(argv[1]) : 8;
+    int num_similar = argc > 2 ? stoi(argv[2]) : 4;
+
+    // the same grid at two sizes, with 16 times more tiles in the second one
+    vector<LightField> grids = {synthetic_scene(5, 64, 80, 1), synthetic_scene(5, 256, 320, 1)};
+    vector<int> tiles;
+    for (const auto &grid: grids) {
+        tiles.push_back(((grid.height + patch_size - 1) / patch_size) * ((grid.width + patch_size - 1) / patch_size));
+    }
+
+    // give the arena of every thread its first block before counting
+    #pragma omp parallel default(none)
+    {
+        ScratchArena::Scope scope(ScratchArena::local());
+        ScratchArena::local().allocate<uint8_t>(1);
+    }
+
+    bool allocates = false;
+    printf("MODE          ALLOCATIONS (%d TILES)   ALLOCATIONS (%d TILES)   PER TILE\n", tiles[0], tiles[1]);
+    for (const string name: {"exhaustive", "incremental", "cost_volume", "integral", "pyramid", "patchmatch"}) {
+        EngineOptions options;
+        options.patch_size = patch_size;
+        options.num_similar = num_similar;
+        options.mode = parse_match_mode(name);
+        if (!match_mode_available(options.mode)) {
+            continue;
+        }
+        // an engine per grid, since a wrapped grid (and the pyramid the engine computes for it) only lasts until the
+        // next wrap of its engine
+        vector<PatchMatchEngine> engines(grids.size(), PatchMatchEngine(options));
+        vector<LightFieldView> scenes;
+        for (size_t g = 0; g < grids.size(); g++) {
+            scenes.push_back(engines[g].wrap_views(grids[g].grid_rows, grids[g].grid_cols, grids[g].height,
+                                                   grids[g].width, grids[g].pitch, LightFieldView(grids[g]).views));
+        }
+        // once to warm up, then counted
+        view_allocations(engines[1], scenes[1]);
+        size_t small = view_allocations(engines[0], scenes[0]);
+        size_t large = view_allocations(engines[1], scenes[1]);
+        double per_tile = ((double) large - (double) small) / (tiles[1] - tiles[0]);
+        printf("%-12s  %22zu   %22zu   %8.3f\n", name.c_str(), small, large, per_tile);
+        allocates = allocates or large != small;
+    }
+    if (allocates) {
+        cout << "REGRESSION: the tile loops allocate on the heap" << endl;
+        return 1;
+    }
+    return 0;
+}
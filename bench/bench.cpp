@@ -0,0 +1,362 @@
+//
+// Benchmark suite: microbenchmarks of the hot kernels, and scaling sweeps of the whole pipeline over synthetic light
+// fields. Every measurement is printed as it is taken and written out as JSON, so that runs of different commits can
+// be compared and the power-law fit of results.txt regenerated.
+//
+
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <omp.h>
+#include <random>
+#include <opencv2/opencv.hpp>
+#include "json_writer.h"
+#include "patchmatch.h"
+#include "sad.h"
+#include "synthetic.h"
+
+using namespace std;
+
+struct BenchOptions {
+    // smaller inputs and shorter sweeps, for a quick check
+    bool quick = false;
+    int repetitions = 3;
+    string json = "bench.json";
+    // exponent of the pixel count above which the scaling sweep reports a regression
+    double max_exponent = 1.2;
+    vector<string> suites = {"micro", "scaling"};
+};
+
+template<typename Run>
+double best_seconds(int repetitions, Run run) {
+    // the fastest of `repetitions` runs, which is the one the rest of the machine disturbed the least
+    double best = INFINITY;
+    for (int k = 0; k < repetitions; k++) {
+        chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+        run();
+        best = min(best, chrono::duration<double>(chrono::high_resolution_clock::now() - start).count());
+    }
+    return best;
+}
+
+string sad_kernel_name() {
+#ifdef SAD_X86
+    if (sad_patch == sad_patch_avx512bw) {
+        return "avx512bw";
+    }
+    if (sad_patch == sad_patch_avx2) {
+        return "avx2";
+    }
+    if (sad_patch == sad_patch_sse2) {
+        return "sse2";
+    }
+#endif
+    return "scalar";
+}
+
+LightField random_views(int grid_rows, int grid_cols, int height, int width, unsigned int seed) {
+    mt19937 generator(seed);
+    LightField field = LightField(grid_rows, grid_cols, 3, height, width);
+    for (auto &value: field.data) {
+        value = (uint8_t) generator();
+    }
+    return field;
+}
+
+void bench_sad(JsonWriter &json, const BenchOptions &options) {
+    // the same random patch pairs for every kernel, so that only the kernel changes
+    LightField field = random_views(1, 2, 256, 256, 0);
+    LightFieldView views(field);
+    int calls = options.quick ? 1 << 14 : 1 << 17;
+    printf("SAD KERNEL     PATCH   NS/CALL     GB/S\n");
+    for (int patch_size: {8, 16, 32}) {
+        mt19937 generator(patch_size);
+        vector<const uint8_t *> references;
+        vector<const uint8_t *> targets;
+        for (int k = 0; k < calls; k++) {
+            int row = (int) (generator() % (256 - patch_size));
+            references.push_back(views.row(0, 0, 0, row) + generator() % (256 - patch_size));
+            targets.push_back(views.row(0, 1, 0, row) + generator() % (256 - patch_size));
+        }
+        auto run_kernel = [&](const string &name, auto kernel) {
+            volatile uint32_t sink = 0;
+            double seconds = best_seconds(options.repetitions, [&] {
+                uint32_t sum = 0;
+                for (int k = 0; k < calls; k++) {
+                    sum += kernel(references[k], targets[k]);
+                }
+                sink = sink + sum;
+            });
+            double nanoseconds = 1e9 * seconds / calls;
+            // both patches are read in full
+            double gigabytes = 2.0 * 3 * patch_size * patch_size * calls / seconds / 1e9;
+            printf("%-12s   %5d   %7.1f   %6.2f\n", name.c_str(), patch_size, nanoseconds, gigabytes);
+            json.begin_object().field("benchmark", "sad").field("kernel", name).field("patch_size", patch_size)
+                    .field("ns_per_call", nanoseconds).field("gb_per_s", gigabytes).end_object();
+        };
+        size_t pitch = views.pitch;
+        size_t stride = views.channel_stride;
+        run_kernel("scalar", [&](const uint8_t *a, const uint8_t *b) {
+            return sad_patch_scalar(a, b, pitch, stride, 3, patch_size, patch_size);
+        });
+        run_kernel(sad_kernel_name(), [&](const uint8_t *a, const uint8_t *b) {
+            return sad_patch(a, b, pitch, stride, 3, patch_size, patch_size);
+        });
+        // with a bound it never reaches, to see the cost of the checks alone
+        run_kernel("bounded", [&](const uint8_t *a, const uint8_t *b) {
+            return sad_patch_bounded(a, b, pitch, stride, 3, patch_size, patch_size, UINT32_MAX);
+        });
+        if (patch_size == 8) {
+            run_kernel("fixed", [&](const uint8_t *a, const uint8_t *b) {
+                return sad_patch_fixed<8, 3>(a, b, pitch, stride);
+            });
+        } else if (patch_size == 16) {
+            run_kernel("fixed", [&](const uint8_t *a, const uint8_t *b) {
+                return sad_patch_fixed<16, 3>(a, b, pitch, stride);
+            });
+        } else {
+            run_kernel("fixed", [&](const uint8_t *a, const uint8_t *b) {
+                return sad_patch_fixed<32, 3>(a, b, pitch, stride);
+            });
+        }
+    }
+}
+
+void bench_top_matches(JsonWriter &json, const BenchOptions &options) {
+    // the candidates of one tile are the views of its row and column, which is 16 views of a 9x9 grid
+    int candidates_per_tile = 16;
+    int tiles = options.quick ? 1 << 12 : 1 << 15;
+    mt19937 generator(0);
+    vector<Match> candidates(tiles * candidates_per_tile);
+    for (auto &candidate: candidates) {
+        candidate = {(int) (generator() % 9), (int) (generator() % 9), (int) (generator() % 512),
+                     (int) (generator() % 512), (uint8_t) generator()};
+    }
+    printf("\nTOP MATCHES    K   NS/INSERT\n");
+    for (int k: {1, 4, 8, 16}) {
+        volatile int sink = 0;
+        double seconds = best_seconds(options.repetitions, [&] {
+            int kept = 0;
+            for (int t = 0; t < tiles; t++) {
+                TopMatches top(k);
+                for (int c = 0; c < candidates_per_tile; c++) {
+                    top.insert(candidates[t * candidates_per_tile + c]);
+                }
+                kept += top[0].difference;
+            }
+            sink = sink + kept;
+        });
+        double nanoseconds = 1e9 * seconds / candidates.size();
+        printf("             %3d   %9.2f\n", k, nanoseconds);
+        json.begin_object().field("benchmark", "top_matches").field("k", k)
+                .field("candidates_per_tile", candidates_per_tile).field("ns_per_insert", nanoseconds).end_object();
+    }
+}
+
+void bench_decode(JsonWriter &json, const BenchOptions &options) {
+    // the views of a synthetic scene written out as images, and decoded back by the engine
+    int grid_size = options.quick ? 3 : 5;
+    int height = options.quick ? 256 : 512;
+    int width = height * 5 / 4;
+    LightField scene = synthetic_scene(grid_size, height, width, 0);
+    filesystem::path directory = filesystem::temp_directory_path() / "patchmatch_bench_decode";
+    filesystem::create_directories(directory);
+    for (int i = 0; i < grid_size; i++) {
+        for (int j = 0; j < grid_size; j++) {
+            cv::Mat image(height, width, CV_8UC3);
+            for (int r = 0; r < height; r++) {
+                uint8_t *pixels = image.ptr<uint8_t>(r);
+                for (int c = 0; c < width; c++) {
+                    // BGR, as openCV expects
+                    for (int k = 0; k < 3; k++) {
+                        pixels[c * 3 + k] = scene.at(i, j, 2 - k, r, c);
+                    }
+                }
+            }
+            char name[32];
+            snprintf(name, sizeof(name), "view_%02d_%02d.png", i, j);
+            cv::imwrite((directory / name).string(), image);
+        }
+    }
+    double seconds = best_seconds(options.repetitions, [&] {
+        LightField decoded = PatchMatchEngine().load_scene(directory.string(), grid_size, grid_size);
+    });
+    filesystem::remove_all(directory);
+
+    int views = grid_size * grid_size;
+    double megapixels = (double) views * height * width / 1e6 / seconds;
+    printf("\nDECODE         VIEWS   MS/VIEW   MPIX/S\n");
+    printf("             %7d   %7.2f   %6.1f\n", views, 1e3 * seconds / views, megapixels);
+    json.begin_object().field("benchmark", "decode").field("views", views).field("height", height)
+            .field("width", width).field("ms_per_view", 1e3 * seconds / views).field("megapixels_per_s", megapixels)
+            .end_object();
+}
+
+void bench_save(JsonWriter &json, const BenchOptions &options) {
+    // npy_save of the frankenpatches of one view
+    int height = options.quick ? 256 : 512;
+    LightField scene_grid = synthetic_scene(3, height, height * 5 / 4, 0);
+    LightFieldView scene(scene_grid);
+    Frankenpatches patches = PatchMatchEngine().frankenpatches(scene, 1, 1);
+    string path = (filesystem::temp_directory_path() / "patchmatch_bench_save.npy").string();
+    double seconds = best_seconds(options.repetitions, [&] {
+        cnpy::npy_save(path, patches.pixels, patches.shape(), "w");
+    });
+    filesystem::remove(path);
+
+    double megabytes = patches.data.size() / 1048576.0;
+    printf("\nSAVE           MIB      MIB/S\n");
+    printf("             %6.1f   %7.1f\n", megabytes, megabytes / seconds);
+    json.begin_object().field("benchmark", "save_data").field("bytes", patches.data.size())
+            .field("mib_per_s", megabytes / seconds).end_object();
+}
+
+struct ScalingCase {
+    int grid_size = 3;
+    int height = 256;
+    int width = 320;
+    int patch_size = 8;
+    int num_similar = 4;
+    int stride = 1;
+    int roi = 3;
+    int threads = omp_get_max_threads();
+};
+
+double match_scene(const ScalingCase &setting, int repetitions) {
+    // frankenpatches of every view of a synthetic scene, one task per view as in main
+    LightField scene_grid = synthetic_scene(setting.grid_size, setting.height, setting.width, setting.height);
+    LightFieldView scene(scene_grid);
+    EngineOptions options;
+    options.patch_size = setting.patch_size;
+    options.num_similar = setting.num_similar;
+    options.stride = setting.stride;
+    options.roi = setting.roi;
+    options.threads = setting.threads;
+    PatchMatchEngine engine(options);
+    return best_seconds(repetitions, [&] {
+        vector<Frankenpatches> patches = engine.frankenpatches(scene);
+    });
+}
+
+void record_case(JsonWriter &json, const string &sweep, int value, const ScalingCase &setting, double seconds) {
+    json.begin_object().field("sweep", sweep).field("value", value).field("pixels", setting.height * setting.width)
+            .field("patch_size", setting.patch_size).field("num_similar", setting.num_similar)
+            .field("stride", setting.stride).field("roi", setting.roi).field("threads", setting.threads)
+            .field("seconds", seconds).end_object();
+}
+
+bool bench_scaling(JsonWriter &json, const BenchOptions &options) {
+    /* One parameter at a time is swept away from the defaults of ScalingCase. The pixel sweep is the one of
+       results.txt, and its power-law fit is checked against max_exponent. Returns false on a regression. */
+    json.key("scaling").begin_array();
+    vector<double> log_pixels;
+    vector<double> log_seconds;
+    printf("NUM PIXELS       PATCH MATCHING TIME (s)\n");
+    for (int side = 64; side <= (options.quick ? 256 : 512); side *= 2) {
+        ScalingCase setting;
+        setting.height = side;
+        setting.width = side * 5 / 4;
+        double seconds = match_scene(setting, options.repetitions);
+        printf("%7d           %8.3f\n", setting.height * setting.width, seconds);
+        record_case(json, "pixels", setting.height * setting.width, setting, seconds);
+        log_pixels.push_back(log((double) setting.height * setting.width));
+        log_seconds.push_back(log(seconds));
+    }
+
+    auto sweep = [&](const string &name, const vector<int> &values, int ScalingCase::*parameter) {
+        printf("\n%-12s     TIME (s)\n", name.c_str());
+        for (int value: values) {
+            ScalingCase setting;
+            setting.*parameter = value;
+            double seconds = match_scene(setting, options.repetitions);
+            printf("%7d           %8.3f\n", value, seconds);
+            record_case(json, name, value, setting, seconds);
+        }
+    };
+    sweep("patch_size", {4, 8, 16, 32}, &ScalingCase::patch_size);
+    sweep("roi", {1, 2, 3, 5, 8}, &ScalingCase::roi);
+    sweep("stride", {1, 2, 4}, &ScalingCase::stride);
+    sweep("num_similar", {1, 2, 4, 8}, &ScalingCase::num_similar);
+    vector<int> threads;
+    for (int count = 1; count < omp_get_max_threads(); count *= 2) {
+        threads.push_back(count);
+    }
+    threads.push_back(omp_get_max_threads());
+    sweep("threads", threads, &ScalingCase::threads);
+    json.end_array();
+
+    // least squares fit of log(time) = b * log(pixels) + log(a)
+    double mean_x = accumulate(log_pixels.begin(), log_pixels.end(), 0.0) / log_pixels.size();
+    double mean_y = accumulate(log_seconds.begin(), log_seconds.end(), 0.0) / log_seconds.size();
+    double covariance = 0, variance = 0;
+    for (size_t k = 0; k < log_pixels.size(); k++) {
+        covariance += (log_pixels[k] - mean_x) * (log_seconds[k] - mean_y);
+        variance += (log_pixels[k] - mean_x) * (log_pixels[k] - mean_x);
+    }
+    double exponent = covariance / variance;
+    double factor = exp(mean_y - exponent * mean_x);
+    printf("\nFit to y=a*x^b => y = %e*x^%f\n", factor, exponent);
+    json.key("fit").begin_object().field("a", factor).field("b", exponent).field("max_b", options.max_exponent)
+            .end_object();
+
+    if (exponent > options.max_exponent) {
+        cout << "REGRESSION: patch matching time grows faster than x^" << options.max_exponent << endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    // [--quick] [--repetitions n] [--json file] [--max-exponent b] [micro] [scaling]
+    BenchOptions options;
+    vector<string> suites;
+    for (int k = 1; k < argc; k++) {
+        string arg = argv[k];
+        if (arg == "--quick") {
+            options.quick = true;
+        } else if (arg == "--repetitions" and k + 1 < argc) {
+            options.repetitions = max(1, stoi(argv[++k]));
+        } else if (arg == "--json" and k + 1 < argc) {
+            options.json = argv[++k];
+        } else if (arg == "--max-exponent" and k + 1 < argc) {
+            options.max_exponent = stod(argv[++k]);
+        } else if (arg == "micro" or arg == "scaling") {
+            suites.push_back(arg);
+        } else {
+            cerr << "unknown argument " << arg << endl;
+            return 2;
+        }
+    }
+    if (!suites.empty()) {
+        options.suites = suites;
+    }
+    auto selected = [&](const string &suite) {
+        return find(options.suites.begin(), options.suites.end(), suite) != options.suites.end();
+    };
+
+    JsonWriter json;
+    json.begin_object().field("threads", omp_get_max_threads()).field("sad_kernel", sad_kernel_name())
+            .field("quick", options.quick).field("repetitions", options.repetitions);
+    bool passed = true;
+    if (selected("micro")) {
+        json.key("micro").begin_array();
+        bench_sad(json, options);
+        bench_top_matches(json, options);
+        bench_decode(json, options);
+        bench_save(json, options);
+        json.end_array();
+        cout << endl;
+    }
+    if (selected("scaling")) {
+        passed = bench_scaling(json, options);
+    }
+    json.end_object();
+
+    ofstream file(options.json);
+    file << json.str() << endl;
+    cout << "\nResults written to " << options.json << endl;
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,277 @@
+//
+// Golden check of the matching over synthetic light fields, without any file: the exhaustive search must produce the
+// recorded frankenpatches, the exact modes must find the same matches as the exhaustive search, and every mode must
+// only return matches inside the views it searches, with the difference of their patch. The approximate modes are
+// compared with the exhaustive search, and fail only beyond --max-loss. The order TopMatches gives to matches of
+// equal difference, on which the frankenpatches depend, is checked first.
+//
+
+#include <algorithm>
+#include <cinttypes>
+#include <iostream>
+#include <iterator>
+#include "patchmatch.h"
+#include "sad.h"
+#include "synthetic.h"
+
+using namespace std;
+
+struct GoldenCase {
+    const char *name;
+    SyntheticConfig scene;
+    int patch_size;
+    int num_similar;
+    int stride;
+    int roi;
+    // FNV-1a hash of the exhaustive frankenpatches of every view, in row-major view order (PatchMatchGolden --record)
+    uint64_t digest;
+};
+
+SyntheticConfig golden_scene(int grid_rows, int grid_cols, int height, int width, double row_disparity,
+                             double col_disparity, double noise, unsigned int seed) {
+    SyntheticConfig config;
+    config.grid_rows = grid_rows;
+    config.grid_cols = grid_cols;
+    config.height = height;
+    config.width = width;
+    config.row_disparity = row_disparity;
+    config.col_disparity = col_disparity;
+    config.noise = noise;
+    config.seed = seed;
+    return config;
+}
+
+// disparities and noise levels are powers of two, so that every product of the generator is exact and the views are
+// the same whether or not the compiler fuses the multiply-adds
+const vector<GoldenCase> golden_cases = {
+        {"square",            golden_scene(5, 5, 64, 80, 1, 1, 0, 1),       8,  4, 1, 3, 0x488ef78e465eb269},
+        {"wide_grid",         golden_scene(3, 7, 48, 96, 2, -1, 0, 2),      8,  6, 1, 3, 0xfbbbe610ac6013be},
+        {"partial_tiles",     golden_scene(4, 4, 61, 77, 1, 2, 0, 3),       16, 3, 1, 4, 0x03f989273ef2a4b0},
+        {"generic_patch",     golden_scene(3, 3, 50, 70, 1, 1, 0, 4),       5,  4, 1, 2, 0x144bbe868ce55943},
+        {"half_pixel",        golden_scene(5, 5, 64, 64, 0.5, 0.5, 0, 5),   8,  4, 1, 3, 0x7583c3e66fa46f38},
+        {"noisy",             golden_scene(5, 5, 64, 80, 1, 1, 2, 6),       8,  4, 1, 3, 0x082ed6051ec2b619},
+        {"stride",            golden_scene(3, 5, 64, 96, 2, 2, 0, 7),       8,  4, 2, 3, 0xfe4183516941dd93},
+};
+
+vector<MatchMode> available_modes(const vector<MatchMode> &modes) {
+    vector<MatchMode> available;
+    copy_if(modes.begin(), modes.end(), back_inserter(available), match_mode_available);
+    return available;
+}
+
+// modes that must find exactly the matches of the exhaustive search (cost_volume only in the builds that have it), and
+// the approximate ones
+const vector<MatchMode> exact_modes = available_modes({MatchMode::incremental, MatchMode::cost_volume,
+                                                       MatchMode::integral});
+const vector<MatchMode> approximate_modes = {MatchMode::pyramid, MatchMode::patchmatch};
+
+const char *mode_name(MatchMode mode) {
+    switch (mode) {
+        case MatchMode::exhaustive:
+            return "exhaustive";
+        case MatchMode::incremental:
+            return "incremental";
+        case MatchMode::cost_volume:
+            return "cost_volume";
+        case MatchMode::integral:
+            return "integral";
+        case MatchMode::pyramid:
+            return "pyramid";
+        case MatchMode::patchmatch:
+            return "patchmatch";
+    }
+    return "";
+}
+
+void hash_bytes(uint64_t &hash, const uint8_t *bytes, size_t size) {
+    for (size_t k = 0; k < size; k++) {
+        hash = (hash ^ bytes[k]) * 1099511628211ull;
+    }
+}
+
+bool same_matches(const ViewMatches &a, const ViewMatches &b, size_t tile) {
+    if (a.size(tile) != b.size(tile)) {
+        return false;
+    }
+    for (int k = 0; k < a.size(tile); k++) {
+        const Match &x = a.at(tile, k);
+        const Match &y = b.at(tile, k);
+        if (x.view_row != y.view_row or x.view_col != y.view_col or x.row != y.row or x.col != y.col or
+            x.difference != y.difference) {
+            return false;
+        }
+    }
+    return true;
+}
+
+long invalid_matches(const LightFieldView &scene, int i, int j, int patch_size, const ViewMatches &matches) {
+    // matches outside of the views searched, outside of the view, or whose difference is not that of their patch
+    long invalid = 0;
+    int tile = 0;
+    for (int h = 0; h < scene.height; h += patch_size) {
+        for (int w = 0; w < scene.width; w += patch_size) {
+            int patchsize[2] = {min(scene.height - h, patch_size), min(scene.width - w, patch_size)};
+            for (int k = 0; k < matches.size(tile); k++) {
+                const Match &match = matches.at(tile, k);
+                bool searched = (match.view_row == i) != (match.view_col == j) and match.view_row >= 0 and
+                                match.view_row < scene.grid_rows and match.view_col >= 0 and
+                                match.view_col < scene.grid_cols;
+                bool inside = match.row >= 0 and match.row + patchsize[0] <= scene.height and match.col >= 0 and
+                              match.col + patchsize[1] <= scene.width;
+                if (not searched or not inside or
+                    match.difference != min(sad_patch_scalar(scene.row(i, j, 0, h) + w,
+                                                             scene.row(match.view_row, match.view_col, 0, match.row) +
+                                                             match.col, scene.pitch, scene.channel_stride,
+                                                             scene.channels, patchsize[0], patchsize[1]) /
+                                            (scene.channels * patchsize[0] * patchsize[1]), 255u)) {
+                    invalid++;
+                }
+            }
+            tile++;
+        }
+    }
+    return invalid;
+}
+
+long perfect_tiles(const ViewMatches &matches) {
+    // tiles whose best match is identical to them
+    long perfect = 0;
+    for (size_t tile = 0; tile < matches.tiles(); tile++) {
+        perfect += matches.size(tile) > 0 and matches.at(tile, 0).difference == 0;
+    }
+    return perfect;
+}
+
+bool top_matches_tie_order() {
+    // the order of TopMatches among equal differences, which the frankenpatches depend on: the first k sorted, a tie
+    // with the worst match dropped, and a match that is kept placed before those with the same difference
+    TopMatches top(3);
+    int differences[] = {5, 3, 5, 5, 3, 4};
+    for (int n = 0; n < 6; n++) {
+        top.insert({n, 0, 0, 0, (uint8_t) differences[n]});
+    }
+    int expected[] = {4, 1, 5};
+    for (int n = 0; n < 3; n++) {
+        if (top[n].view_row != expected[n]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    // --record prints the digests of the exhaustive search instead of checking them, after a deliberate change to it.
+    // --max-loss bounds the increase of the mean difference of the matches of the approximate modes, in grey levels,
+    // which are only reported otherwise
+    bool record = false;
+    double max_loss = INFINITY;
+    for (int a = 1; a < argc; a++) {
+        string arg = argv[a];
+        if (arg == "--record") {
+            record = true;
+        } else if (arg == "--max-loss" and a + 1 < argc) {
+            max_loss = stod(argv[++a]);
+        } else {
+            throw invalid_argument("usage: PatchMatchGolden [--record] [--max-loss grey_levels]");
+        }
+    }
+    vector<MatchMode> modes = {MatchMode::exhaustive};
+    modes.insert(modes.end(), exact_modes.begin(), exact_modes.end());
+    modes.insert(modes.end(), approximate_modes.begin(), approximate_modes.end());
+
+    bool failed = !top_matches_tie_order();
+    printf("CASE            MODE          RESULT\n");
+    printf("%-14s  %-12s  %-6s  %s\n", "tie_order", "top_matches", failed ? "FAILED" : "ok",
+           failed ? "the order of equal differences changed" : "equal differences in the expected order");
+    for (const GoldenCase &golden: golden_cases) {
+        // an engine per mode, each with the pyramid of the scene that mode needs
+        LightField scene_grid = synthetic_scene(golden.scene);
+        vector<PatchMatchEngine> engines;
+        vector<LightFieldView> scenes;
+        for (MatchMode mode: modes) {
+            EngineOptions options;
+            options.patch_size = golden.patch_size;
+            options.num_similar = golden.num_similar;
+            options.stride = golden.stride;
+            options.roi = golden.roi;
+            options.mode = mode;
+            engines.emplace_back(options);
+        }
+        for (auto &engine: engines) {
+            scenes.push_back(engine.wrap_views(scene_grid.grid_rows, scene_grid.grid_cols, scene_grid.height,
+                                               scene_grid.width, scene_grid.pitch, LightFieldView(scene_grid).views));
+        }
+        const LightFieldView &scene = scenes[0];
+        // only the approximate modes, which come last, are compared with the exhaustive search
+        size_t first_approximate = modes.size() - approximate_modes.size();
+
+        uint64_t digest = 14695981039346656037ull;
+        long tiles = 0;
+        long perfect = 0;
+        vector<long> invalid(modes.size());
+        vector<long> differing(modes.size());
+        vector<MatchQuality> quality(modes.size());
+        #pragma omp parallel default(none) \
+                shared(golden, engines, scenes, scene, first_approximate, modes, digest, tiles, perfect, invalid, \
+                       differing, quality)
+        #pragma omp single
+        for (int i = 0; i < scene.grid_rows; i++) {
+            for (int j = 0; j < scene.grid_cols; j++) {
+                // the views one after the other, the tiles of each view are spread over the threads by the engine
+                ViewMatches exhaustive = engines[0].match(scene, i, j);
+                Frankenpatches patches = engines[0].frankenpatches(scene, i, j, exhaustive);
+                hash_bytes(digest, patches.pixels, patches.data.size());
+                tiles += exhaustive.tiles();
+                perfect += perfect_tiles(exhaustive);
+                for (size_t m = 0; m < modes.size(); m++) {
+                    ViewMatches matches = m == 0 ? exhaustive : engines[m].match(scenes[m], i, j);
+                    invalid[m] += invalid_matches(scene, i, j, golden.patch_size, matches);
+                    for (size_t tile = 0; tile < exhaustive.tiles(); tile++) {
+                        differing[m] += !same_matches(matches, exhaustive, tile);
+                    }
+                    if (m >= first_approximate) {
+                        MatchQuality view_quality = engines[m].compare_with_exhaustive(scenes[m], i, j, matches);
+                        quality[m].matches += view_quality.matches;
+                        quality[m].identical += view_quality.identical;
+                        quality[m].difference += view_quality.difference;
+                        quality[m].exhaustive_difference += view_quality.exhaustive_difference;
+                    }
+                }
+            }
+        }
+
+        for (size_t m = 0; m < modes.size(); m++) {
+            bool exact = m <= exact_modes.size();
+            double loss = (quality[m].difference - quality[m].exhaustive_difference) / quality[m].matches;
+            string result;
+            bool passed = invalid[m] == 0;
+            if (m == 0) {
+                char digits[64];
+                snprintf(digits, sizeof(digits), "digest 0x%016" PRIx64 ", ", digest);
+                result = record ? digits : digest == golden.digest ? "digest ok, " : "DIGEST CHANGED, ";
+                passed = passed and (record or digest == golden.digest);
+                result += to_string(100 * perfect / tiles) + "% of the tiles matched perfectly";
+            } else if (exact) {
+                result = to_string(differing[m]) + " tiles differ from exhaustive";
+                passed = passed and differing[m] == 0;
+            } else {
+                char summary[128];
+                snprintf(summary, sizeof(summary), "mean difference %+.2f, %.1f%% of the matches identical", loss,
+                         100.0 * quality[m].identical / quality[m].matches);
+                result = summary;
+                passed = passed and loss <= max_loss;
+            }
+            if (invalid[m] != 0) {
+                result += ", " + to_string(invalid[m]) + " invalid matches";
+            }
+            printf("%-14s  %-12s  %-6s  %s\n", golden.name, mode_name(modes[m]), passed ? "ok" : "FAILED",
+                   result.c_str());
+            failed = failed or !passed;
+        }
+    }
+    if (failed) {
+        cout << "REGRESSION: the matching does not reproduce the golden output" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,138 @@
+//
+// Benchmark of the output formats: size on disk, write throughput and latency of random tile reads. Every format is
+// written by PatchMatchEngine::write from the same matches, so the write includes the assembly of the frankenpatches
+// (or of the match table) and their compression. The match tables are also read back whole, and must reconstruct the
+// frankenpatches they were made from byte for byte.
+//
+
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include "patchmatch.h"
+#include "synthetic.h"
+
+using namespace std;
+
+double elapsed(chrono::high_resolution_clock::time_point start) {
+    return chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+}
+
+int main(int argc, char **argv) {
+    /* Frankenpatches of a real scene (scene_dir grid_size_0 grid_size_1) or, without arguments, of a synthetic one.
+       The synthetic texture is random noise, which is the worst case for the compressed format. */
+    PatchMatchEngine engine;
+    LightField scene_grid = argc > 3 ? engine.load_scene(argv[1], stoi(argv[2]), stoi(argv[3]))
+                                     : synthetic_scene(3, 512, 640, 1);
+    LightFieldView scene(scene_grid);
+    int patch_size = engine.options().patch_size;
+    int num_reads = 200;
+
+    vector<ViewMatches> view_matches;
+    vector<Frankenpatches> outputs;
+    size_t raw_bytes = 0;
+    for (int i = 0; i < scene.grid_rows; i++) {
+        for (int j = 0; j < scene.grid_cols; j++) {
+            view_matches.push_back(engine.match(scene, i, j));
+            outputs.push_back(engine.frankenpatches(scene, i, j, view_matches.back()));
+            raw_bytes += outputs.back().data.size();
+        }
+    }
+    filesystem::path directory = filesystem::temp_directory_path() / "patchmatch_output_formats";
+    filesystem::create_directories(directory);
+
+    // the same random tiles for every format
+    mt19937 generator(0);
+    vector<vector<int>> reads;
+    for (int k = 0; k < num_reads; k++) {
+        reads.push_back({(int) (generator() % outputs.size()), (int) (generator() % scene.height) / patch_size,
+                         (int) (generator() % scene.width) / patch_size});
+    }
+
+    printf("%d views of %dx%dx%d, %.1f MiB in total\n", (int) outputs.size(), scene.height, scene.width,
+           outputs[0].channels, raw_bytes / 1048576.0);
+    printf("FORMAT   SIZE (MiB)   WRITE (MiB/s)   TILE READ (us)\n");
+    for (const string format: {"npy", "mmap", "npz", "matches"}) {
+        auto path = [&](size_t view) {
+            return (directory / ("view_" + to_string(view) + (format == "npy" or format == "mmap" ? ".npy" : ".npz")))
+                    .string();
+        };
+
+        chrono::high_resolution_clock::time_point start = chrono::high_resolution_clock::now();
+        {
+            AsyncWriter writer;
+            #pragma omp parallel default(none) shared(engine, scene, view_matches, format, path, writer)
+            #pragma omp single
+            for (size_t view = 0; view < view_matches.size(); view++) {
+                engine.write(scene, (int) view / scene.grid_cols, (int) view % scene.grid_cols, view_matches[view],
+                             parse_output_format(format), path(view), writer);
+            }
+        }
+        double write_seconds = elapsed(start);
+        size_t file_bytes = 0;
+        for (size_t view = 0; view < outputs.size(); view++) {
+            file_bytes += filesystem::file_size(path(view));
+        }
+
+        // copy one tile out of a random view, the way a training loader reads them
+        vector<uint8_t> tile(patch_size * patch_size * outputs[0].channels);
+        size_t tile_row_bytes = patch_size * outputs[0].channels;
+        // the match tables are read back into the frankenpatches of a whole view, of which only the tile is filled
+        Frankenpatches reconstructed = Frankenpatches(scene.height, scene.width, outputs[0].channels);
+        start = chrono::high_resolution_clock::now();
+        for (const auto &read: reads) {
+            const Frankenpatches &output = outputs[read[0]];
+            size_t row_bytes = (size_t) output.width * output.channels;
+            size_t column = (size_t) read[2] * patch_size * output.channels;
+            int rows = min(patch_size, output.height - read[1] * patch_size);
+            size_t width = min(tile_row_bytes, row_bytes - column);
+            const uint8_t *pixels;
+            cnpy::NpyArray array;
+            cnpy::NpyMap file;
+            if (format == "npy") {
+                array = cnpy::npy_load(path(read[0]));
+                pixels = array.data<uint8_t>() + read[1] * patch_size * row_bytes;
+            } else if (format == "mmap") {
+                file = cnpy::npy_map_load(path(read[0]));
+                pixels = file.data<uint8_t>() + read[1] * patch_size * row_bytes;
+            } else if (format == "npz") {
+                array = cnpy::npz_load(path(read[0]), "rows_" + to_string(read[1] * patch_size));
+                pixels = array.data<uint8_t>();
+            } else {
+                engine.reconstruct(scene, engine.load_matches(path(read[0])), read[1], read[2], reconstructed);
+                pixels = reconstructed.pixels + read[1] * patch_size * row_bytes;
+            }
+            for (int r = 0; r < rows; r++) {
+                copy(pixels + r * row_bytes + column, pixels + r * row_bytes + column + width,
+                     tile.begin() + r * tile_row_bytes);
+            }
+        }
+        double read_seconds = elapsed(start);
+
+        // and check the last tile against the frankenpatches it was written from
+        const vector<int> &read = reads.back();
+        const Frankenpatches &output = outputs[read[0]];
+        for (int r = 0; r < min(patch_size, output.height - read[1] * patch_size); r++) {
+            for (int m = 0; m < min(patch_size, output.width - read[2] * patch_size) * output.channels; m++) {
+                if (tile[r * tile_row_bytes + m] != output.at(read[1] * patch_size + r, read[2] * patch_size, m)) {
+                    cout << format << ": the tile read back differs from the one written" << endl;
+                    return 1;
+                }
+            }
+        }
+
+        // the match tables must give back every frankenpatch exactly, through the file
+        for (size_t view = 0; format == "matches" and view < outputs.size(); view++) {
+            Frankenpatches patches = engine.reconstruct(scene, engine.load_matches(path(view)));
+            if (patches.data != outputs[view].data) {
+                cout << "matches: the frankenpatches of view " << view << " differ once reconstructed" << endl;
+                return 1;
+            }
+        }
+
+        printf("%-7s  %10.1f   %13.1f   %14.1f\n", format.c_str(), file_bytes / 1048576.0,
+               raw_bytes / 1048576.0 / write_seconds, 1e6 * read_seconds / num_reads);
+    }
+    filesystem::remove_all(directory);
+    return 0;
+}
@@ -1,69 +1,286 @@
+#include <chrono>
+#include <fstream>
 #include <iostream>
-#include "utils.cpp"
+#include <sstream>
 #include <vector>
+#include "patchmatch.h"
+#include "profiler.h"
 
 #ifdef _OPENMP
     #include <omp.h>
 #endif
 
-void compute_save_patches(const std::string& scene_dir,
-                          const vector<vector<vector<vector<vector<uint8_t>>>>>& scene,
-                          const vector<string>& scene_names,
-                          int i,
-                          int j,
-                          int patch_size,
-                          int num_patches,
-                          int stride,
-                          int roi) {
-    /* Compute and save patches for a given scene and for view i, j
-       This function is separated from main to allow parallelization */
-    // main part of the function, compute the frankenpatches
-    vector<vector<vector<uint8_t>>> patches = get_frankenpatches(scene,
-                                                                         i,
-                                                                         j,
-                                                                         patch_size,
-                                                                         num_patches,
-                                                                         stride,
-                                                                         roi);
+using namespace std;
+
+void save_patches(const PatchMatchEngine& engine,
+                  const string& scene_dir,
+                  const LightFieldView& scene,
+                  const vector<string>& scene_names,
+                  int i,
+                  int j,
+                  ViewMatches&& view_matches,
+                  OutputFormat output,
+                  bool compare,
+                  MatchQuality& quality,
+                  AsyncWriter& writer) {
+    /* Save the patches of view i, j of a given scene, as soon as the engine has matched it
+       This function is called by the tasks of the engine, so the views are saved in parallel */
+    MatchMode mode = engine.options().mode;
+    if (compare and (mode == MatchMode::pyramid or mode == MatchMode::patchmatch)) {
+        // also run the exhaustive search, to report how much the approximate search gives up. That costs more than
+        // the approximate search itself, so it is only done on request (--compare)
+        MatchQuality view_quality = engine.compare_with_exhaustive(scene, i, j, view_matches);
+        #pragma omp critical
+        {
+            quality.matches += view_quality.matches;
+            quality.identical += view_quality.identical;
+            quality.difference += view_quality.difference;
+            quality.exhaustive_difference += view_quality.exhaustive_difference;
+        }
+    }
     string new_name = scene_dir + "/frankenpatches/";
 
-    // get the filename of the original scene, and change the extension to .npy
-    string filename = scene_names[i * scene[i].size() + j];
+    // get the filename of the original scene, and change the extension to that of the output format
+    string filename = scene_names[i * scene.grid_cols + j];
     filename = filename.substr(filename.find_last_of("/\\") + 1);
     string::size_type const p(filename.find_last_of('.'));
-    filename = filename.substr(0, p) + ".npy";
+    if (output == OutputFormat::matches) {
+        filename = filename.substr(0, p) + "_matches.npz";
+    } else {
+        filename = filename.substr(0, p) + (output == OutputFormat::npz ? ".npz" : ".npy");
+    }
 
-    // save the patches
     new_name += filename;
-    save_data(patches, new_name);
+    engine.write(scene, i, j, view_matches, output, new_name, writer);
 }
 
-int main(int argc, char **argv) {
-    string scene_dir = argv[1];
-    int grid_size_0 = stoi(argv[2]);
-    int grid_size_1 = stoi(argv[3]);
+struct SceneJob {
+    // one scene to process, with the positional arguments of the command line
+    string scene_dir;
+    int grid_size_0;
+    int grid_size_1;
+    int patch_size;
+    int num_patches;
+    int stride;
+    int roi;
+    MatchMode mode;
+    int pyramid_levels;
+    int iterations;
+    size_t max_memory;
+    OutputFormat output;
+    // report how the matches of the approximate modes compare with those of the exhaustive search
+    bool compare;
+};
+
+struct SceneResult {
+    MatchQuality quality;
+    // number of views decoded by the bounded-memory mode (0 otherwise)
+    size_t decoded = 0;
+    long long milliseconds = 0;
+    // what stopped the scene, empty if it was processed to the end
+    string error;
+};
+
+SceneJob parse_scene_job(const vector<string> &args) {
+    if (args.size() < 7) {
+        throw invalid_argument("expected scene_dir grid_size_0 grid_size_1 patch_size num_patches stride roi "
+                               "[mode] [pyramid levels or iterations] [memory cap in MiB]");
+    }
+    SceneJob job;
+    job.scene_dir = args[0];
+    job.grid_size_0 = stoi(args[1]);
+    job.grid_size_1 = stoi(args[2]);
+
+    job.patch_size = stoi(args[3]);
+    job.num_patches = stoi(args[4]);
+    if (job.num_patches > max_similar) {
+        throw invalid_argument("num_patches can be at most " + to_string(max_similar));
+    }
+    job.stride = stoi(args[5]);
+    job.roi = stoi(args[6]);
+    // optional, defaults to the brute-force search
+    job.mode = args.size() > 7 ? parse_match_mode(args[7]) : MatchMode::exhaustive;
+    // optional, number of coarser levels of the pyramid mode, or of iterations of the patchmatch mode
+    job.pyramid_levels = args.size() > 8 ? stoi(args[8]) : 2;
+    job.iterations = args.size() > 8 ? stoi(args[8]) : 4;
+    // optional, memory cap in MiB for the views of the scene. 0 (the default) loads the whole scene at once
+    job.max_memory = args.size() > 9 ? stoul(args[9]) << 20 : 0;
+    job.output = OutputFormat::npy;
+    job.compare = false;
+    return job;
+}
 
-    int patch_size = stoi(argv[4]);
-    int num_patches = stoi(argv[5]);
-    int stride = stoi(argv[6]);
-    int roi = stoi(argv[7]);
+vector<SceneJob> read_manifest(const string &filename) {
+    // one scene per line, with the same arguments as the command line. Empty lines and lines starting with '#' are
+    // skipped
+    ifstream manifest(filename);
+    if (!manifest) {
+        throw runtime_error("cannot open the manifest " + filename);
+    }
+    vector<SceneJob> jobs;
+    string line;
+    while (getline(manifest, line)) {
+        istringstream fields(line);
+        vector<string> args;
+        string field;
+        while (fields >> field) {
+            args.push_back(field);
+        }
+        if (args.empty() or args[0][0] == '#') {
+            continue;
+        }
+        jobs.push_back(parse_scene_job(args));
+    }
+    return jobs;
+}
 
+void process_scene(const SceneJob &job, SceneResult &result, AsyncWriter &writer) {
+    /* Load, match and save one scene. Meant to be called by a single thread of a parallel region: the views are
+       loaded and matched by OpenMP tasks, and this only returns once all of them are done. */
     chrono::high_resolution_clock::time_point t1 = chrono::high_resolution_clock::now();
 
-    // get the views as uint8_t and the names of each view
-    vector<vector<vector<vector<vector<uint8_t>>>>> scene = get_scene_grid(scene_dir, grid_size_0, grid_size_1);
-    vector<string> scene_names = get_scene_names(scene_dir, grid_size_0, grid_size_1);
+    EngineOptions options;
+    options.patch_size = job.patch_size;
+    options.num_similar = job.num_patches;
+    options.stride = job.stride;
+    options.roi = job.roi;
+    options.mode = job.mode;
+    options.pyramid_levels = job.pyramid_levels;
+    options.iterations = job.iterations;
+    PatchMatchEngine engine(options);
+
+    // get the names of each view, and save every view as soon as it is matched. With a memory cap, only the rows and
+    // columns of the views being matched are kept in memory
+    vector<string> scene_names = get_scene_names(job.scene_dir, job.grid_size_0, job.grid_size_1);
+    result.decoded = engine.process_scene(job.scene_dir, job.grid_size_0, job.grid_size_1, job.max_memory,
+                                          [&](const LightFieldView &scene, int i, int j, ViewMatches &&matches) {
+        save_patches(engine, job.scene_dir, scene, scene_names, i, j, move(matches), job.output, job.compare,
+                     result.quality, writer);
+    });
+
+    chrono::high_resolution_clock::time_point t2 = chrono::high_resolution_clock::now();
+    result.milliseconds = chrono::duration_cast<chrono::milliseconds>(t2 - t1).count();
+}
+
+// number of scenes being processed at the same time in batch mode: while one scene is matched, the next one is
+// loaded, and the writes of the previous one finish
+constexpr int scenes_in_flight = 2;
+
+int main(int argc, char **argv) {
+    // optionally --output followed by the output format (npy by default), --profile and --trace followed by the files
+    // to dump the timers to (as JSON and as a Chrome trace), --compare to also run the exhaustive search and report
+    // what the approximate modes give up, then either the arguments of a single scene, or --batch followed by a
+    // manifest with one scene per line
+    vector<string> args(argv + 1, argv + argc);
+    OutputFormat output = OutputFormat::npy;
+    bool compare = false;
+    string profile_file;
+    string trace_file;
+    while (!args.empty()) {
+        if (args[0] == "--compare") {
+            compare = true;
+            args.erase(args.begin());
+        } else if (args.size() >= 2 and args[0] == "--output") {
+            output = parse_output_format(args[1]);
+            args.erase(args.begin(), args.begin() + 2);
+        } else if (args.size() >= 2 and args[0] == "--profile") {
+            profile_file = args[1];
+            args.erase(args.begin(), args.begin() + 2);
+        } else if (args.size() >= 2 and args[0] == "--trace") {
+            trace_file = args[1];
+            args.erase(args.begin(), args.begin() + 2);
+        } else {
+            break;
+        }
+    }
+    // keeping every timed interval is only worth it for the trace
+    Profiler::global().set_tracing(!trace_file.empty());
+    bool batch = !args.empty() and args[0] == "--batch";
+    vector<SceneJob> jobs;
+    if (batch) {
+        if (args.size() < 2) {
+            throw invalid_argument("expected --batch manifest");
+        }
+        jobs = read_manifest(args[1]);
+    } else {
+        jobs.push_back(parse_scene_job(args));
+    }
+    for (auto &job: jobs) {
+        job.output = output;
+        job.compare = compare;
+    }
+    vector<SceneResult> results(jobs.size());
+    // every output of every scene goes through a single writer thread
+    AsyncWriter writer;
+
+    chrono::high_resolution_clock::time_point t1 = chrono::high_resolution_clock::now();
 
-    #pragma omp parallel for default(none) shared(scene_dir, scene, scene_names, patch_size, num_patches, stride, roi)
-    for (int i = 0; i < scene.size(); i++) {
-        for (int j = 0; j < scene[i].size(); j++) {
-            compute_save_patches(scene_dir, scene, scene_names, i, j, patch_size, num_patches, stride, roi);
+    // a single pool of threads for every scene. Each scene is a task, and the scene scenes_in_flight places further
+    // in the manifest only starts once it is done, which bounds the memory to scenes_in_flight scenes. A scene that
+    // fails is reported at the end, and the others go on (an exception cannot leave a task anyway)
+    [[maybe_unused]] int in_flight[scenes_in_flight];
+    #pragma omp parallel default(none) shared(jobs, results, in_flight, writer)
+    #pragma omp single
+    for (size_t k = 0; k < jobs.size(); k++) {
+        #pragma omp task default(none) firstprivate(k) shared(jobs, results, in_flight, writer) \
+                depend(inout: in_flight[k % scenes_in_flight])
+        try {
+            process_scene(jobs[k], results[k], writer);
+        } catch (const exception &error) {
+            results[k].error = error.what();
         }
     }
+    writer.finish();
 
     chrono::high_resolution_clock::time_point t2 = chrono::high_resolution_clock::now();
     // get the time in milliseconds
     auto duration = chrono::duration_cast<chrono::milliseconds>( t2 - t1 ).count();
+    size_t failed = 0;
+    for (size_t k = 0; k < jobs.size(); k++) {
+        const MatchQuality &quality = results[k].quality;
+        if (!results[k].error.empty()) {
+            cerr << jobs[k].scene_dir << ": failed, " << results[k].error << endl;
+            failed++;
+            continue;
+        }
+        if (batch) {
+            cout << jobs[k].scene_dir << ": " << results[k].milliseconds << " milliseconds" << endl;
+        }
+        if (results[k].decoded > 0) {
+            cout << "Views decoded: " << results[k].decoded << " for a grid of "
+                 << jobs[k].grid_size_0 * jobs[k].grid_size_1 << endl;
+        }
+        if (quality.matches > 0) {
+            printf("Approximate matching: mean difference %.2f (exhaustive %.2f), %.1f%% of the matches identical\n",
+                   quality.difference / quality.matches,
+                   quality.exhaustive_difference / quality.matches,
+                   100.0 * quality.identical / quality.matches);
+        }
+    }
+    WriterStats stats = writer.stats();
+    if (stats.files > 0) {
+        printf("Writer: %zu files, %.1f MiB at %.1f MiB/s, queue depth %.1f on average (max %zu), "
+               "submissions waited %.1f ms\n",
+               stats.files,
+               stats.bytes / 1048576.0,
+               stats.write_seconds > 0 ? stats.bytes / 1048576.0 / stats.write_seconds : 0.0,
+               stats.mean_depth,
+               stats.max_depth,
+               1000 * stats.stall_seconds);
+    }
+    if (stats.failed > 0) {
+        cerr << "Writer: " << stats.failed << " outputs could not be written, the first: " << stats.first_error
+             << endl;
+    }
     cout << "Time taken: " << duration << " milliseconds" << endl;
-    return 0;
+    if (!profile_file.empty()) {
+        ofstream(profile_file) << Profiler::global().json() << endl;
+    }
+    if (!trace_file.empty()) {
+        ofstream(trace_file) << Profiler::global().chrome_trace() << endl;
+    }
+    if (failed > 0) {
+        cerr << failed << " of " << jobs.size() << " scenes failed" << endl;
+    }
+    return failed > 0 or stats.failed > 0 ? 1 : 0;
 }
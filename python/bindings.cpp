@@ -0,0 +1,193 @@
+//
+// Python bindings of PatchMatchEngine (module patchmatch): numpy arrays of views in, numpy arrays of frankenpatches
+// out, with the same dtype and shape as the .npy files of the command line.
+//
+
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+#include <pybind11/numpy.h>
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+#include "cnpy.h"
+#include "patchmatch.h"
+
+namespace py = pybind11;
+
+template<typename T>
+py::dtype npy_dtype() {
+    // the descr cnpy writes in the header of a .npy array of T, so that the arrays are those np.load reads back
+    return py::dtype::from_args(py::str(std::string(1, cnpy::BigEndianTest()) + cnpy::map_type(typeid(T)) +
+                                        std::to_string(sizeof(T))));
+}
+
+template<typename Owner>
+py::capsule owning_capsule(Owner *owner) {
+    // hands the ownership of a C++ object over to the numpy array whose base it becomes
+    return py::capsule(owner, [](void *pointer) {
+        delete static_cast<Owner *>(pointer);
+    });
+}
+
+py::array to_array(Frankenpatches &&patches) {
+    // the buffer of the frankenpatches is moved under the array, not copied, with the (H, W, C) shape of save_data
+    auto *data = new std::vector<uint8_t>(std::move(patches.data));
+    std::vector<size_t> shape = patches.shape();
+    return py::array(npy_dtype<uint8_t>(), std::vector<py::ssize_t>(shape.begin(), shape.end()), data->data(),
+                     owning_capsule(data));
+}
+
+struct ViewBuffers {
+    /* Pointers to the views of a numpy array, taken while holding the GIL so that the matching can run without it.
+       `array` keeps the array (or its contiguous copy) alive for as long as the pointers are used. */
+    py::array array;
+    bool planar;
+    int grid_rows;
+    int grid_cols;
+    int height;
+    int width;
+    size_t pitch;
+    std::vector<const uint8_t *> views;
+};
+
+ViewBuffers view_buffers(const py::array &views, bool planar) {
+    /* Either (grid_rows, grid_cols, height, width, 3) RGB images, as decoded images and np.stack give them, which
+       are copied into the planes the matching works on, or with planar, (grid_rows, grid_cols, 3, height, width)
+       planes with contiguous rows (as PatchMatchEngine.load_scene returns them), which are matched in place. */
+    ViewBuffers buffers;
+    buffers.planar = planar;
+    if (planar) {
+        if (views.ndim() != 5 or views.shape(2) != 3 or views.dtype().kind() != 'u' or views.itemsize() != 1) {
+            throw std::invalid_argument("expected a uint8 array of shape (grid_rows, grid_cols, 3, height, width)");
+        }
+        buffers.array = views;
+        // the channels of a view must be one after the other, with the same rows, and every row contiguous
+        if (views.strides(4) != 1 or views.strides(3) < views.shape(4) or
+            views.strides(2) != views.strides(3) * views.shape(3) or views.strides(0) < 0 or views.strides(1) < 0) {
+            throw std::invalid_argument("the planes of every view must be contiguous, with contiguous rows");
+        }
+    } else {
+        buffers.array = py::array_t<uint8_t, py::array::c_style | py::array::forcecast>::ensure(views);
+        if (!buffers.array or buffers.array.ndim() != 5 or buffers.array.shape(4) != 3) {
+            throw std::invalid_argument("expected an array of shape (grid_rows, grid_cols, height, width, 3)");
+        }
+    }
+    const py::array &array = buffers.array;
+    buffers.grid_rows = (int) array.shape(0);
+    buffers.grid_cols = (int) array.shape(1);
+    buffers.height = (int) array.shape(planar ? 3 : 2);
+    buffers.width = (int) array.shape(planar ? 4 : 3);
+    buffers.pitch = planar ? (size_t) array.strides(3) : (size_t) buffers.width * 3;
+    const auto *data = static_cast<const uint8_t *>(array.data());
+    for (int i = 0; i < buffers.grid_rows; i++) {
+        for (int j = 0; j < buffers.grid_cols; j++) {
+            buffers.views.push_back(data + i * array.strides(0) + j * array.strides(1));
+        }
+    }
+    return buffers;
+}
+
+class PyEngine {
+    /* PatchMatchEngine behind a mutex, as the same engine may be called from several Python threads once the GIL is
+       released, and the views handed to it go through its own storage. */
+public:
+    explicit PyEngine(const EngineOptions &options) : engine(options) {}
+
+    py::array frankenpatches(const py::array &views, int i, int j, bool planar) {
+        ViewBuffers buffers = view_buffers(views, planar);
+        if (i < 0 or i >= buffers.grid_rows or j < 0 or j >= buffers.grid_cols) {
+            throw std::out_of_range("no view (" + std::to_string(i) + ", " + std::to_string(j) + ") in the grid");
+        }
+        Frankenpatches patches = [&] {
+            py::gil_scoped_release release;
+            std::lock_guard<std::mutex> lock(mutex);
+            return engine.frankenpatches(scene(buffers), i, j);
+        }();
+        return to_array(std::move(patches));
+    }
+
+    py::list all_frankenpatches(const py::array &views, bool planar) {
+        ViewBuffers buffers = view_buffers(views, planar);
+        std::vector<Frankenpatches> patches = [&] {
+            py::gil_scoped_release release;
+            std::lock_guard<std::mutex> lock(mutex);
+            return engine.frankenpatches(scene(buffers));
+        }();
+        py::list arrays;
+        for (auto &view: patches) {
+            arrays.append(to_array(std::move(view)));
+        }
+        return arrays;
+    }
+
+    py::array load_scene(const std::string &scene_dir, int grid_rows, int grid_cols) {
+        // the planes of the grid as they are stored, rows padded to the pitch included, so that nothing is copied
+        auto *field = new LightField([&] {
+            py::gil_scoped_release release;
+            return engine.load_scene(scene_dir, grid_rows, grid_cols);
+        }());
+        std::vector<py::ssize_t> shape = {field->grid_rows, field->grid_cols, field->channels, field->height,
+                                          field->width};
+        std::vector<py::ssize_t> strides = {(py::ssize_t) (field->view_stride * field->grid_cols),
+                                            (py::ssize_t) field->view_stride, (py::ssize_t) field->channel_stride,
+                                            (py::ssize_t) field->pitch, 1};
+        return py::array(npy_dtype<uint8_t>(), shape, strides, field->data.data(), owning_capsule(field));
+    }
+
+    const EngineOptions &options() const {
+        return engine.options();
+    }
+
+private:
+    LightFieldView scene(const ViewBuffers &buffers) {
+        if (buffers.planar) {
+            return engine.wrap_views(buffers.grid_rows, buffers.grid_cols, buffers.height, buffers.width,
+                                     buffers.pitch, buffers.views);
+        }
+        return engine.import_views(buffers.grid_rows, buffers.grid_cols, buffers.height, buffers.width,
+                                   buffers.views);
+    }
+
+    PatchMatchEngine engine;
+    std::mutex mutex;
+};
+
+PYBIND11_MODULE(patchmatch, module) {
+    module.doc() = "Frankenpatches of light fields held in numpy arrays, without going through files";
+
+    py::class_<PyEngine>(module, "Engine")
+            .def(py::init([](int patch_size, int num_similar, int stride, int roi, const std::string &mode,
+                             int pyramid_levels, int iterations, int threads) {
+                     EngineOptions options;
+                     options.patch_size = patch_size;
+                     options.num_similar = num_similar;
+                     options.stride = stride;
+                     options.roi = roi;
+                     options.mode = parse_match_mode(mode);
+                     options.pyramid_levels = pyramid_levels;
+                     options.iterations = iterations;
+                     options.threads = threads;
+                     return std::make_unique<PyEngine>(options);
+                 }),
+                 py::arg("patch_size") = 8, py::arg("num_similar") = 4, py::arg("stride") = 1, py::arg("roi") = 3,
+                 py::arg("mode") = "exhaustive", py::arg("pyramid_levels") = 2, py::arg("iterations") = 4,
+                 py::arg("threads") = 0)
+            .def("frankenpatches", &PyEngine::frankenpatches, py::arg("views"), py::arg("i"), py::arg("j"),
+                 py::arg("planar") = false,
+                 "Frankenpatches of view (i, j), as a uint8 array of shape (height, width, 3 * (num_similar + 1))")
+            .def("all_frankenpatches", &PyEngine::all_frankenpatches, py::arg("views"), py::arg("planar") = false,
+                 "Frankenpatches of every view, in row-major view order, the views being matched in parallel")
+            .def("load_scene", &PyEngine::load_scene, py::arg("scene_dir"), py::arg("grid_rows"),
+                 py::arg("grid_cols"),
+                 "Views of a scene directory, as the planar array that frankenpatches takes with planar=True")
+            .def_property_readonly("patch_size", [](const PyEngine &engine) {
+                return engine.options().patch_size;
+            })
+            .def_property_readonly("num_similar", [](const PyEngine &engine) {
+                return engine.options().num_similar;
+            });
+}
@@ -0,0 +1,95 @@
+#
+# Smoke test of the Python bindings (ctest python_bindings): the frankenpatches the module returns for a synthetic
+# scene, from interleaved images, from the planar views of load_scene and for the whole grid at once, must be those the
+# command line writes for the same scene.
+#
+# usage: test_bindings.py path/to/PatchMatch directory/of/the/module
+#
+
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+import zlib
+
+try:
+    import numpy as np
+except ImportError:
+    print("numpy is not installed, skipping")
+    sys.exit(77)
+
+GRID_ROWS = 3
+GRID_COLS = 3
+HEIGHT = 37
+WIDTH = 45
+PATCH_SIZE = 8
+NUM_SIMILAR = 4
+STRIDE = 1
+ROI = 3
+
+
+def write_png(path, image):
+    # 8-bit RGB, every row with filter 0, which is all the decoder of the command line needs
+    def chunk(kind, data):
+        return struct.pack(">I", len(data)) + kind + data + struct.pack(">I", zlib.crc32(kind + data) & 0xffffffff)
+
+    height, width, _ = image.shape
+    rows = b"".join(b"\x00" + image[r].tobytes() for r in range(height))
+    with open(path, "wb") as png:
+        png.write(b"\x89PNG\r\n\x1a\n")
+        png.write(chunk(b"IHDR", struct.pack(">IIBBBBB", width, height, 8, 2, 0, 0, 0)))
+        png.write(chunk(b"IDAT", zlib.compress(rows)))
+        png.write(chunk(b"IEND", b""))
+
+
+def synthetic_views(seed):
+    # a random texture seen from every view, shifted by one pixel from one view to the next, so that every tile has
+    # exact matches in the other views of its row and column
+    generator = np.random.default_rng(seed)
+    texture = generator.integers(0, 256, (HEIGHT + GRID_ROWS, WIDTH + GRID_COLS, 3), dtype=np.uint8)
+    views = np.empty((GRID_ROWS, GRID_COLS, HEIGHT, WIDTH, 3), dtype=np.uint8)
+    for i in range(GRID_ROWS):
+        for j in range(GRID_COLS):
+            views[i, j] = texture[i:i + HEIGHT, j:j + WIDTH]
+    return views
+
+
+def check(name, actual, expected):
+    if actual.dtype != np.uint8 or actual.shape != expected.shape or not np.array_equal(actual, expected):
+        print(f"{name}: {actual.dtype} {actual.shape} differs from the command line output {expected.shape}")
+        sys.exit(1)
+
+
+def main():
+    cli, module_dir = sys.argv[1], sys.argv[2]
+    sys.path.insert(0, module_dir)
+    import patchmatch
+
+    views = synthetic_views(0)
+    with tempfile.TemporaryDirectory() as scene_dir:
+        for i in range(GRID_ROWS):
+            for j in range(GRID_COLS):
+                write_png(os.path.join(scene_dir, f"view_{i:02d}_{j:02d}.png"), views[i, j])
+        os.makedirs(os.path.join(scene_dir, "frankenpatches"))
+        subprocess.run([cli, scene_dir, str(GRID_ROWS), str(GRID_COLS), str(PATCH_SIZE), str(NUM_SIMILAR),
+                        str(STRIDE), str(ROI)], check=True, stdout=subprocess.DEVNULL)
+        expected = [np.load(os.path.join(scene_dir, "frankenpatches", f"view_{i:02d}_{j:02d}.npy"))
+                    for i in range(GRID_ROWS) for j in range(GRID_COLS)]
+
+        engine = patchmatch.Engine(PATCH_SIZE, NUM_SIMILAR, STRIDE, ROI)
+        planar = engine.load_scene(scene_dir, GRID_ROWS, GRID_COLS)
+
+    # the decoded views are the images written, only in planes
+    check("load_scene", np.ascontiguousarray(planar.transpose(0, 1, 3, 4, 2)), views)
+    for v, patches in enumerate(expected):
+        i, j = divmod(v, GRID_COLS)
+        check(f"frankenpatches({i}, {j})", engine.frankenpatches(views, i, j), patches)
+        check(f"frankenpatches({i}, {j}, planar=True)", engine.frankenpatches(planar, i, j, planar=True), patches)
+    for v, patches in enumerate(engine.all_frankenpatches(views)):
+        check(f"all_frankenpatches[{v}]", patches, expected[v])
+    print("the bindings give the frankenpatches of the command line")
+
+
+if __name__ == "__main__":
+    main()
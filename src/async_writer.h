@@ -0,0 +1,164 @@
+//
+// Background writer for the .npy outputs, so that the matching threads do not wait on the disk.
+//
+
+#ifndef ASYNC_WRITER_H
+#define ASYNC_WRITER_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "cnpy.h"
+#include "profiler.h"
+
+// default number of finished outputs that can wait for the writer before submit blocks
+constexpr size_t async_writer_capacity = 16;
+
+struct WriterStats {
+    size_t files = 0;
+    size_t bytes = 0;
+    // time the writer spent in npy_save, and time the submitting threads spent waiting for room in the queue
+    double write_seconds = 0;
+    double stall_seconds = 0;
+    // number of outputs already waiting when a new one was submitted
+    size_t max_depth = 0;
+    double mean_depth = 0;
+    // outputs that could not be written, and the error of the first one
+    size_t failed = 0;
+    std::string first_error;
+};
+
+class AsyncWriter {
+    /* A dedicated thread writing the uint8 arrays handed to it as .npy files (or the members compressed by the caller
+       as .npz archives), in submission order. The queue holds at most `capacity` outputs, and submit blocks while it
+       is full, so a disk slower than the matching throttles the matching instead of piling up finished outputs in
+       memory. finish (or the destructor) waits for every write. An output that cannot be written is counted in the
+       stats and skipped, so that one bad path does not stop the others. */
+public:
+    explicit AsyncWriter(size_t capacity = async_writer_capacity) :
+            capacity(std::max<size_t>(1, capacity)), done(false), depth_sum(0), submitted(0),
+            worker([this] { run(); }) {}
+
+    ~AsyncWriter() {
+        finish();
+    }
+
+    AsyncWriter(const AsyncWriter &) = delete;
+
+    AsyncWriter &operator=(const AsyncWriter &) = delete;
+
+    void submit(std::string filename, std::vector<uint8_t> data, std::vector<size_t> shape) {
+        enqueue({std::move(filename), std::move(data), std::move(shape), {}});
+    }
+
+    void submit(std::string filename, std::vector<cnpy::NpzMember> members) {
+        enqueue({std::move(filename), {}, {}, std::move(members)});
+    }
+
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            done = true;
+        }
+        not_empty.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    WriterStats stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        WriterStats current = statistics;
+        current.mean_depth = submitted > 0 ? static_cast<double>(depth_sum) / submitted : 0;
+        return current;
+    }
+
+private:
+    struct Output {
+        std::string filename;
+        // either a raw array and its shape, or the members of an archive
+        std::vector<uint8_t> data;
+        std::vector<size_t> shape;
+        std::vector<cnpy::NpzMember> members;
+    };
+
+    void enqueue(Output output) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return queue.size() < capacity; });
+        statistics.stall_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        statistics.max_depth = std::max(statistics.max_depth, queue.size());
+        depth_sum += queue.size();
+        queue.push_back(std::move(output));
+        submitted++;
+        not_empty.notify_one();
+    }
+
+    void run() {
+        Profiler::global().name_thread("writer");
+        while (true) {
+            Output output;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                not_empty.wait(lock, [this] { return !queue.empty() or done; });
+                if (queue.empty()) {
+                    return;
+                }
+                output = std::move(queue.front());
+                queue.pop_front();
+            }
+            not_full.notify_one();
+
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            size_t bytes = output.data.size();
+            try {
+                ProfileScope scope(Phase::write);
+                if (output.members.empty()) {
+                    cnpy::npy_save(output.filename, output.data.data(), output.shape, "w");
+                } else {
+                    cnpy::npz_write(output.filename, output.members);
+                    bytes = 0;
+                    for (const auto &member: output.members) {
+                        bytes += member.compressed.size();
+                    }
+                }
+            } catch (const std::exception &error) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (statistics.failed++ == 0) {
+                    statistics.first_error = error.what();
+                }
+                continue;
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            profile_count(Counter::files_written, 1);
+            profile_count(Counter::bytes_written, bytes);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            statistics.files++;
+            statistics.bytes += bytes;
+            statistics.write_seconds += seconds;
+        }
+    }
+
+    size_t capacity;
+    bool done;
+    std::deque<Output> queue;
+    mutable std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    WriterStats statistics;
+    size_t depth_sum;
+    size_t submitted;
+    // started last, once everything it uses is initialised
+    std::thread worker;
+};
+
+#endif //ASYNC_WRITER_H
@@ -4,6 +4,7 @@
 
 #include"cnpy.h"
 #include<complex>
+#include<cerrno>
 #include<cstdlib>
 #include<algorithm>
 #include<cstring>
@@ -11,6 +12,10 @@
 #include<stdint.h>
 #include<stdexcept>
 #include <regex>
+#include<fcntl.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include<unistd.h>
 
 char cnpy::BigEndianTest() {
     int x = 1;
@@ -59,15 +64,14 @@ template<> std::vector<char>& cnpy::operator+=(std::vector<char>& lhs, const cha
     return lhs;
 }
 
-void cnpy::parse_npy_header(unsigned char* buffer,size_t& word_size, std::vector<size_t>& shape, bool& fortran_order) {
-    //std::string magic_string(buffer,6);
-    uint8_t major_version = *reinterpret_cast<uint8_t*>(buffer+6);
-    uint8_t minor_version = *reinterpret_cast<uint8_t*>(buffer+7);
-    uint16_t header_len = *reinterpret_cast<uint16_t*>(buffer+8);
-    std::string header(reinterpret_cast<char*>(buffer+9),header_len);
-
+//fields of the header dictionary of a .npy array, the text after the magic string, version and length
+static void parse_npy_dict(const std::string& header, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order, char& type) {
     size_t loc1, loc2;
 
+    if(header.find("fortran_order") == std::string::npos || header.find("(") == std::string::npos ||
+       header.find(")") == std::string::npos || header.find("descr") == std::string::npos)
+        throw std::runtime_error("parse_npy_header: failed to find header keyword");
+
     //fortran order
     loc1 = header.find("fortran_order")+16;
     fortran_order = (header.substr(loc1,4) == "True" ? true : false);
@@ -93,15 +97,22 @@ void cnpy::parse_npy_header(unsigned char* buffer,size_t& word_size, std::vector
     bool littleEndian = (header[loc1] == '<' || header[loc1] == '|' ? true : false);
     assert(littleEndian);
 
-    //char type = header[loc1+1];
-    //assert(type == map_type(T));
+    //kind of the data type, as map_type gives it
+    type = header[loc1+1];
 
     std::string str_ws = header.substr(loc1+2);
     loc2 = str_ws.find("'");
     word_size = atoi(str_ws.substr(0,loc2).c_str());
 }
 
-void cnpy::parse_npy_header(FILE* fp, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order) {  
+void cnpy::parse_npy_header(unsigned char* buffer,size_t& word_size, std::vector<size_t>& shape, bool& fortran_order, char& type) {
+    //std::string magic_string(buffer,6);
+    uint16_t header_len = *reinterpret_cast<uint16_t*>(buffer+8);
+    std::string header(reinterpret_cast<char*>(buffer+9),header_len);
+    parse_npy_dict(header, word_size, shape, fortran_order, type);
+}
+
+void cnpy::parse_npy_header(FILE* fp, size_t& word_size, std::vector<size_t>& shape, bool& fortran_order, char& type) {  
     char buffer[256];
     size_t res = fread(buffer,sizeof(char),11,fp);       
     if(res != 11)
@@ -144,8 +155,8 @@ void cnpy::parse_npy_header(FILE* fp, size_t& word_size, std::vector<size_t>& sh
     bool littleEndian = (header[loc1] == '<' || header[loc1] == '|' ? true : false);
     assert(littleEndian);
 
-    //char type = header[loc1+1];
-    //assert(type == map_type(T));
+    //kind of the data type, as map_type gives it
+    type = header[loc1+1];
 
     std::string str_ws = header.substr(loc1+2);
     loc2 = str_ws.find("'");
@@ -179,9 +190,11 @@ cnpy::NpyArray load_the_npy_file(FILE* fp) {
     std::vector<size_t> shape;
     size_t word_size;
     bool fortran_order;
-    cnpy::parse_npy_header(fp,word_size,shape,fortran_order);
+    char type;
+    cnpy::parse_npy_header(fp,word_size,shape,fortran_order,type);
 
     cnpy::NpyArray arr(shape, word_size, fortran_order);
+    arr.type = type;
     size_t nread = fread(arr.data<char>(),1,arr.num_bytes(),fp);
     if(nread != arr.num_bytes())
         throw std::runtime_error("load_the_npy_file: failed fread");
@@ -217,9 +230,11 @@ cnpy::NpyArray load_the_npz_array(FILE* fp, uint32_t compr_bytes, uint32_t uncom
     std::vector<size_t> shape;
     size_t word_size;
     bool fortran_order;
-    cnpy::parse_npy_header(&buffer_uncompr[0],word_size,shape,fortran_order);
+    char type;
+    cnpy::parse_npy_header(&buffer_uncompr[0],word_size,shape,fortran_order,type);
 
     cnpy::NpyArray array(shape, word_size, fortran_order);
+    array.type = type;
 
     size_t offset = uncompr_bytes - array.num_bytes();
     memcpy(array.data<unsigned char>(),&buffer_uncompr[0]+offset,array.num_bytes());
@@ -312,8 +327,8 @@ cnpy::NpyArray cnpy::npz_load(std::string fname, std::string varname) {
             return array;
         }
         else {
-            //skip past the data
-            uint32_t size = *(uint32_t*) &local_header[22];
+            //skip past the (possibly compressed) data
+            uint32_t size = *(uint32_t*) &local_header[18];
             fseek(fp,size,SEEK_CUR);
         }
     }
@@ -336,5 +351,237 @@ cnpy::NpyArray cnpy::npy_load(std::string fname) {
     return arr;
 }
 
+cnpy::NpyMap::NpyMap(NpyMap&& other) noexcept :
+    shape(std::move(other.shape)), word_size(other.word_size), fortran_order(other.fortran_order),
+    type(other.type), num_vals(other.num_vals), base(other.base), length(other.length), offset(other.offset),
+    writable(other.writable) {
+    other.base = nullptr;
+    other.length = 0;
+}
+
+cnpy::NpyMap& cnpy::NpyMap::operator=(NpyMap&& other) noexcept {
+    if(this != &other) {
+        unmap();
+        shape = std::move(other.shape);
+        word_size = other.word_size;
+        fortran_order = other.fortran_order;
+        type = other.type;
+        num_vals = other.num_vals;
+        base = other.base;
+        length = other.length;
+        offset = other.offset;
+        writable = other.writable;
+        other.base = nullptr;
+        other.length = 0;
+    }
+    return *this;
+}
+
+cnpy::NpyMap::~NpyMap() {
+    unmap();
+}
+
+void cnpy::NpyMap::close() {
+    //the pages written into a created file are flushed before the unmap, which would otherwise drop any error of
+    //their writeback
+    bool synced = !base || !writable || msync(base, length, MS_SYNC) == 0;
+    int error = errno;
+    unmap();
+    if(!synced) throw std::runtime_error(std::string("NpyMap::close: Unable to write the mapped file back: ")+
+                                         strerror(error));
+}
+
+void cnpy::NpyMap::unmap() noexcept {
+    if(base) munmap(base, length);
+    base = nullptr;
+    length = 0;
+    writable = false;
+}
+
+cnpy::NpyMap cnpy::npy_map_create(std::string fname, const std::vector<char>& header, const std::vector<size_t>& shape, size_t word_size) {
+    NpyMap map;
+    map.shape = shape;
+    map.word_size = word_size;
+    map.fortran_order = false;
+    map.num_vals = std::accumulate(shape.begin(), shape.end(), size_t(1), std::multiplies<size_t>());
+    map.offset = header.size();
+    map.length = header.size() + map.num_vals * word_size;
+
+    int fd = open(fname.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) throw std::runtime_error("npy_map_create: Unable to open file "+fname);
+    //the blocks of the whole file are reserved up front, so that a full filesystem fails here rather than with a
+    //SIGBUS on the first write into the mapping. if that or the mapping fails, the file is removed rather than left
+    //behind empty or full of zeros
+    int error = posix_fallocate(fd, 0, map.length);
+    if(error != 0) {
+        ::close(fd);
+        unlink(fname.c_str());
+        throw std::runtime_error("npy_map_create: Unable to allocate "+std::to_string(map.length)+" bytes for file "+
+                                 fname+": "+strerror(error));
+    }
+    void* base = mmap(nullptr, map.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(base == MAP_FAILED) {
+        unlink(fname.c_str());
+        throw std::runtime_error("npy_map_create: Unable to map file "+fname);
+    }
+    map.base = static_cast<char*>(base);
+    map.writable = true;
+    memcpy(map.base, header.data(), header.size());
+    return map;
+}
 
+cnpy::NpyMap cnpy::npy_map_load(std::string fname) {
+    int fd = open(fname.c_str(), O_RDONLY);
+    if(fd < 0) throw std::runtime_error("npy_map_load: Unable to open file "+fname);
+    struct stat status;
+    if(fstat(fd, &status) != 0 || status.st_size < 10) {
+        ::close(fd);
+        throw std::runtime_error("npy_map_load: Not an npy file "+fname);
+    }
+    void* base = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(base == MAP_FAILED) throw std::runtime_error("npy_map_load: Unable to map file "+fname);
+
+    NpyMap map;
+    map.base = static_cast<char*>(base);
+    map.length = status.st_size;
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(map.base);
+    if(memcmp(bytes, "\x93NUMPY", 6) != 0)
+        throw std::runtime_error("npy_map_load: Not an npy file "+fname);
+    //magic string, version, then the little-endian length of the header: 2 bytes in version 1.0, 4 in 2.0 and 3.0
+    size_t prefix, header_len;
+    if(bytes[6] == 1) {
+        prefix = 10;
+        header_len = bytes[8] | bytes[9] << 8;
+    }
+    else if((bytes[6] == 2 || bytes[6] == 3) && map.length >= 12) {
+        prefix = 12;
+        header_len = bytes[8] | bytes[9] << 8 | bytes[10] << 16 | size_t(bytes[11]) << 24;
+    }
+    else throw std::runtime_error("npy_map_load: Unsupported npy version in "+fname);
+    if(prefix + header_len > map.length)
+        throw std::runtime_error("npy_map_load: Truncated header in "+fname);
+    parse_npy_dict(std::string(map.base + prefix, header_len), map.word_size, map.shape, map.fortran_order,
+                   map.type);
+    map.offset = prefix + header_len;
+    map.num_vals = std::accumulate(map.shape.begin(), map.shape.end(), size_t(1), std::multiplies<size_t>());
+    if(map.offset + map.num_vals * map.word_size > map.length)
+        throw std::runtime_error("npy_map_load: Truncated file "+fname);
+    return map;
+}
 
+cnpy::NpzMember cnpy::npz_deflate(std::string fname, const std::vector<char>& npy_header, const char* data, size_t nbytes, int level) {
+    //the archives are written without zip64 records, so every size and offset must fit in 32 bits
+    if(nbytes > UINT32_MAX - npy_header.size())
+        throw std::runtime_error("npz_deflate: "+fname+" is over the 4 GiB a member can hold without zip64");
+    NpzMember member;
+    member.fname = fname;
+    member.uncompressed_bytes = npy_header.size() + nbytes;
+    member.crc = crc32(0L,(const uint8_t*)&npy_header[0],npy_header.size());
+    member.crc = crc32(member.crc,(const uint8_t*)data,nbytes);
+
+    //raw deflate stream (no zlib header), which is what zip members hold
+    z_stream stream;
+    stream.zalloc = Z_NULL;
+    stream.zfree = Z_NULL;
+    stream.opaque = Z_NULL;
+    if(deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        throw std::runtime_error("npz_deflate: deflateInit2 failed for "+fname);
+    member.compressed.resize(deflateBound(&stream, member.uncompressed_bytes));
+    stream.next_out = (Bytef*) &member.compressed[0];
+    stream.avail_out = member.compressed.size();
+
+    stream.next_in = (Bytef*) &npy_header[0];
+    stream.avail_in = npy_header.size();
+    int err = deflate(&stream, Z_NO_FLUSH);
+    if(err == Z_OK) {
+        stream.next_in = (Bytef*) data;
+        stream.avail_in = nbytes;
+        err = deflate(&stream, Z_FINISH);
+    }
+    member.compressed.resize(stream.total_out);
+    deflateEnd(&stream);
+    if(err != Z_STREAM_END)
+        throw std::runtime_error("npz_deflate: deflate failed for "+fname);
+    return member;
+}
+
+void cnpy::npz_write(std::string zipname, const std::vector<NpzMember>& members) {
+    //without zip64 records, the archive is limited to 65535 members and 4 GiB of sizes and offsets. it is checked
+    //before the file is created, so that nothing is left behind
+    if(members.size() > UINT16_MAX)
+        throw std::runtime_error("npz_write: too many members for "+zipname);
+    size_t archive_bytes = 0;
+    for(const NpzMember& member : members) {
+        if(member.fname.size() > UINT16_MAX)
+            throw std::runtime_error("npz_write: member name too long for "+zipname);
+        archive_bytes += 30 + member.fname.size() + member.compressed.size();
+    }
+    if(archive_bytes > UINT32_MAX)
+        throw std::runtime_error("npz_write: "+zipname+" is over the 4 GiB an archive can hold without zip64");
+
+    FILE* fp = fopen(zipname.c_str(),"wb");
+    if(!fp) throw std::runtime_error("npz_write: Unable to open file "+zipname);
+    //a short write (a full disk) removes the file and throws rather than leaving a truncated archive behind
+    auto write = [&](const void* bytes, size_t size) {
+        if(size > 0 && fwrite(bytes,sizeof(char),size,fp) != size) {
+            fclose(fp);
+            unlink(zipname.c_str());
+            throw std::runtime_error("npz_write: Unable to write file "+zipname);
+        }
+    };
+
+    std::vector<char> global_header;
+    size_t offset = 0;
+    for(const NpzMember& member : members) {
+        //same headers as npz_save, with the deflate compression method
+        std::vector<char> local_header;
+        local_header += "PK"; //first part of sig
+        local_header += (uint16_t) 0x0403; //second part of sig
+        local_header += (uint16_t) 20; //min version to extract
+        local_header += (uint16_t) 0; //general purpose bit flag
+        local_header += (uint16_t) 8; //compression method: deflate
+        local_header += (uint16_t) 0; //file last mod time
+        local_header += (uint16_t) 0;     //file last mod date
+        local_header += (uint32_t) member.crc; //crc
+        local_header += (uint32_t) member.compressed.size(); //compressed size
+        local_header += (uint32_t) member.uncompressed_bytes; //uncompressed size
+        local_header += (uint16_t) member.fname.size(); //fname length
+        local_header += (uint16_t) 0; //extra field length
+        local_header += member.fname;
+
+        global_header += "PK"; //first part of sig
+        global_header += (uint16_t) 0x0201; //second part of sig
+        global_header += (uint16_t) 20; //version made by
+        global_header.insert(global_header.end(),local_header.begin()+4,local_header.begin()+30);
+        global_header += (uint16_t) 0; //file comment length
+        global_header += (uint16_t) 0; //disk number where file starts
+        global_header += (uint16_t) 0; //internal file attributes
+        global_header += (uint32_t) 0; //external file attributes
+        global_header += (uint32_t) offset; //relative offset of local file header
+        global_header += member.fname;
+
+        write(local_header.data(),local_header.size());
+        write(member.compressed.data(),member.compressed.size());
+        offset += local_header.size() + member.compressed.size();
+    }
+
+    std::vector<char> footer;
+    footer += "PK"; //first part of sig
+    footer += (uint16_t) 0x0605; //second part of sig
+    footer += (uint16_t) 0; //number of this disk
+    footer += (uint16_t) 0; //disk where footer starts
+    footer += (uint16_t) members.size(); //number of records on this disk
+    footer += (uint16_t) members.size(); //total number of records
+    footer += (uint32_t) global_header.size(); //nbytes of global headers
+    footer += (uint32_t) offset; //offset of start of global headers
+    footer += (uint16_t) 0; //zip file comment length
+
+    write(global_header.data(),global_header.size());
+    write(footer.data(),footer.size());
+    if(fclose(fp) != 0) {
+        unlink(zipname.c_str());
+        throw std::runtime_error("npz_write: Unable to write file "+zipname);
+    }
+}
@@ -23,7 +23,7 @@ namespace cnpy {
 
     struct NpyArray {
         NpyArray(const std::vector<size_t>& _shape, size_t _word_size, bool _fortran_order) :
-            shape(_shape), word_size(_word_size), fortran_order(_fortran_order)
+            shape(_shape), word_size(_word_size), fortran_order(_fortran_order), type(0)
         {
             num_vals = 1;
             for(size_t i = 0;i < shape.size();i++) num_vals *= shape[i];
@@ -31,7 +31,7 @@ namespace cnpy {
                 new std::vector<char>(num_vals * word_size));
         }
 
-        NpyArray() : shape(0), word_size(0), fortran_order(0), num_vals(0) { }
+        NpyArray() : shape(0), word_size(0), fortran_order(0), type(0), num_vals(0) { }
 
         template<typename T>
         T* data() {
@@ -57,20 +57,81 @@ namespace cnpy {
         std::vector<size_t> shape;
         size_t word_size;
         bool fortran_order;
+        //kind of the data type from the descr of the header ('u', 'i', 'f', ...), as map_type gives it
+        char type;
         size_t num_vals;
     };
    
     using npz_t = std::map<std::string, NpyArray>; 
 
+    //one array of a .npz archive, serialized and deflated in memory (npz_deflate), so that the members of an archive
+    //can be compressed in parallel before npz_write puts them together
+    struct NpzMember {
+        std::string fname;
+        std::vector<char> compressed;
+        uint32_t crc;
+        uint32_t uncompressed_bytes;
+    };
+
+    //a .npy file mapped in memory, either created with its header and still to be filled (npy_map_create) or an
+    //existing file opened read-only (npy_map_load). the data is the mapped file itself, without any copy
+    struct NpyMap {
+        NpyMap() : shape(0), word_size(0), fortran_order(0), type(0), num_vals(0), base(nullptr), length(0), offset(0),
+                   writable(false) { }
+        NpyMap(const NpyMap&) = delete;
+        NpyMap& operator=(const NpyMap&) = delete;
+        NpyMap(NpyMap&& other) noexcept;
+        NpyMap& operator=(NpyMap&& other) noexcept;
+        ~NpyMap();
+
+        template<typename T>
+        T* data() {
+            return reinterpret_cast<T*>(base+offset);
+        }
+
+        template<typename T>
+        const T* data() const {
+            return reinterpret_cast<const T*>(base+offset);
+        }
+
+        size_t num_bytes() const {
+            return num_vals * word_size;
+        }
+
+        //unmap the file, after which the data is no longer accessible. a created file is first written back to disk,
+        //and close throws if that fails. the destructor only unmaps, leaving the writeback to the kernel without any
+        //report of its errors, so a created file is meant to be closed explicitly once filled
+        void close();
+
+        //unmap without writing back, as the destructor does
+        void unmap() noexcept;
+
+        std::vector<size_t> shape;
+        size_t word_size;
+        bool fortran_order;
+        char type;
+        size_t num_vals;
+
+        char* base;
+        size_t length;
+        size_t offset;
+        //created by npy_map_create, and written back by close
+        bool writable;
+    };
+
     char BigEndianTest();
     char map_type(const std::type_info& t);
     template<typename T> std::vector<char> create_npy_header(const std::vector<size_t>& shape);
-    void parse_npy_header(FILE* fp,size_t& word_size, std::vector<size_t>& shape, bool& fortran_order);
-    void parse_npy_header(unsigned char* buffer,size_t& word_size, std::vector<size_t>& shape, bool& fortran_order);
+    void parse_npy_header(FILE* fp,size_t& word_size, std::vector<size_t>& shape, bool& fortran_order, char& type);
+    void parse_npy_header(unsigned char* buffer,size_t& word_size, std::vector<size_t>& shape, bool& fortran_order, char& type);
     void parse_zip_footer(FILE* fp, uint16_t& nrecs, size_t& global_header_size, size_t& global_header_offset);
     npz_t npz_load(std::string fname);
     NpyArray npz_load(std::string fname, std::string varname);
     NpyArray npy_load(std::string fname);
+    NpyMap npy_map_create(std::string fname, const std::vector<char>& header, const std::vector<size_t>& shape, size_t word_size);
+    NpyMap npy_map_load(std::string fname);
+    NpzMember npz_deflate(std::string fname, const std::vector<char>& npy_header, const char* data, size_t nbytes, int level);
+    void npz_write(std::string zipname, const std::vector<NpzMember>& members);
 
     template<typename T> std::vector<char>& operator+=(std::vector<char>& lhs, const T rhs) {
         //write in little endian
@@ -95,7 +156,8 @@ namespace cnpy {
             //file exists. we need to append to it. read the header, modify the array size
             size_t word_size;
             bool fortran_order;
-            parse_npy_header(fp,word_size,true_data_shape,fortran_order);
+            char type;
+            parse_npy_header(fp,word_size,true_data_shape,fortran_order,type);
             assert(!fortran_order);
 
             if(word_size != sizeof(T)) {
@@ -117,6 +179,7 @@ namespace cnpy {
         }
         else {
             fp = fopen(fname.c_str(),"wb");
+            if(!fp) throw std::runtime_error("npy_save: Unable to open file "+fname);
             true_data_shape = shape;
         }
 
@@ -130,6 +193,19 @@ namespace cnpy {
         fclose(fp);
     }
 
+    //create fname with the header of an array of the given shape, sized for the data, and map it for writing
+    template<typename T> NpyMap npy_map_create(std::string fname, const std::vector<size_t>& shape) {
+        NpyMap map = npy_map_create(fname, create_npy_header<T>(shape), shape, sizeof(T));
+        map.type = map_type(typeid(T));
+        return map;
+    }
+
+    //deflate the array fname (".npy" is appended) into a member of a future .npz archive. thread safe
+    template<typename T> NpzMember npz_deflate(std::string fname, const T* data, const std::vector<size_t>& shape, int level = Z_DEFAULT_COMPRESSION) {
+        size_t nels = std::accumulate(shape.begin(),shape.end(),size_t(1),std::multiplies<size_t>());
+        return npz_deflate(fname + ".npy", create_npy_header<T>(shape), reinterpret_cast<const char*>(data), nels*sizeof(T), level);
+    }
+
     template<typename T> void npz_save(std::string zipname, std::string fname, const T* data, const std::vector<size_t>& shape, std::string mode = "w")
     {
         //first, append a .npy to the fname
@@ -0,0 +1,134 @@
+//
+// Tile matching costs between two views of a light field, for every shift along the epipolar line.
+//
+
+#ifndef COST_VOLUME_H
+#define COST_VOLUME_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <stdexcept>
+#include <vector>
+#include "lightfield.h"
+
+// the tiles of a band are disjoint and each one tries every shift of its own window, so the band profiles never do
+// less arithmetic than the SIMD kernels scanning the tiles one by one. The volume is only used when the build sets
+// PATCHMATCH_COST_VOLUME to 1, and the cost_volume mode is otherwise rejected
+#ifndef PATCHMATCH_COST_VOLUME
+    #define PATCHMATCH_COST_VOLUME 0
+#endif
+
+class CostVolume {
+    /* Cost volume of one (reference view, target view) pair. The reference view is split into the same
+       patch_size x patch_size tiles get_frankenpatches uses, and for a shift d the volume holds, for every tile,
+       the SAD between the tile and the patch d pixels further along the epipolar line in the target view (columns
+       for views in the same row, rows for views in the same column).
+       The volume is built lazily, one band of tiles along the epipolar direction (a tile row for horizontal
+       shifts, a tile column for vertical ones) and one shift at a time, the first time a tile of the band asks for
+       that shift. The absolute differences of the band are summed across it, and the tiles are box-filtered out of
+       the prefix sums (the integral image) of that profile. That costs O(band pixels) regardless of the patch size,
+       and every later lookup of that shift is O(1). Every band has room for the `shifts` different shifts the
+       caller may ask for, in one flat array for the whole volume, so the volume makes the same few allocations
+       whatever the number of tiles. */
+public:
+    CostVolume(const LightFieldView &grid, int i, int j, int view_row, int view_col, int patch_size, size_t shifts) :
+            grid(grid), i(i), j(j), view_row(view_row), view_col(view_col), patch_size(patch_size),
+            vertical(view_col == j), tile_rows((grid.height + patch_size - 1) / patch_size),
+            tile_cols((grid.width + patch_size - 1) / patch_size), bands(vertical ? tile_cols : tile_rows),
+            band_tiles(vertical ? tile_rows : tile_cols), extent(vertical ? grid.height : grid.width),
+            max_shifts(std::max<size_t>(1, shifts)), slot_of_shift(static_cast<size_t>(bands) * (2 * extent + 1), -1),
+            used(bands, 0), planes(static_cast<size_t>(bands) * max_shifts * band_tiles) {}
+
+    // SAD between the tile with top-left corner (start_row, start_col) and the target patch `shift` pixels away.
+    // The shifted patch must lie inside the target view. The size of the patch is implied by the tile, so the rows
+    // and cols of the interface of IntegralCosts are ignored
+    uint32_t cost(int start_row, int start_col, int, int, int shift) {
+        int band = (vertical ? start_col : start_row) / patch_size;
+        int tile = (vertical ? start_row : start_col) / patch_size;
+        // the shifts the window can reach lie in (-extent, extent)
+        int &slot = slot_of_shift[static_cast<size_t>(band) * (2 * extent + 1) + shift + extent];
+        if (slot < 0) {
+            if (static_cast<size_t>(used[band]) == max_shifts) {
+                throw std::logic_error("a band of the cost volume was asked for more shifts than it was sized for");
+            }
+            slot = used[band]++;
+            compute_band(band, shift, &planes[(static_cast<size_t>(band) * max_shifts + slot) * band_tiles]);
+        }
+        return planes[(static_cast<size_t>(band) * max_shifts + slot) * band_tiles + tile];
+    }
+
+private:
+    void compute_band(int band, int shift, uint32_t *plane) {
+        // region of the reference view covered by the band
+        int first_row = vertical ? 0 : band * patch_size;
+        int first_col = vertical ? band * patch_size : 0;
+        int height = vertical ? grid.height : std::min(grid.height - first_row, patch_size);
+        int width = vertical ? std::min(grid.width - first_col, patch_size) : grid.width;
+
+        // absolute differences summed over the channels and across the band, so that the profile only runs along
+        // the band. Pixels whose shifted position falls outside of the target view contribute nothing
+        int length = vertical ? height : width;
+        profile.assign(length + 1, 0);
+        int row_shift = vertical ? shift : 0;
+        int col_shift = vertical ? 0 : shift;
+        int valid_rows_from = std::max(0, -first_row - row_shift);
+        int valid_rows_to = std::min(height, grid.height - first_row - row_shift);
+        int valid_cols_from = std::max(0, -first_col - col_shift);
+        int valid_cols_to = std::min(width, grid.width - first_col - col_shift);
+        for (int c = 0; c < grid.channels; c++) {
+            for (int r = valid_rows_from; r < valid_rows_to; r++) {
+                const uint8_t *reference = grid.row(i, j, c, first_row + r) + first_col;
+                const uint8_t *target = grid.row(view_row, view_col, c, first_row + r + row_shift) + first_col +
+                                        col_shift;
+                if (vertical) {
+                    uint32_t sum = 0;
+                    for (int m = valid_cols_from; m < valid_cols_to; m++) {
+                        sum += abs(target[m] - reference[m]);
+                    }
+                    profile[r + 1] += sum;
+                } else {
+                    uint32_t *sum = &profile[1];
+                    for (int m = valid_cols_from; m < valid_cols_to; m++) {
+                        sum[m] += abs(target[m] - reference[m]);
+                    }
+                }
+            }
+        }
+        // integral of the profile, so that every tile is a difference of two entries
+        for (int k = 1; k <= length; k++) {
+            profile[k] += profile[k - 1];
+        }
+
+        for (int t = 0; t < band_tiles; t++) {
+            int start = t * patch_size;
+            int end = std::min(length, start + patch_size);
+            plane[t] = profile[end] - profile[start];
+        }
+    }
+
+    const LightFieldView &grid;
+    int i;
+    int j;
+    int view_row;
+    int view_col;
+    int patch_size;
+    bool vertical;
+    int tile_rows;
+    int tile_cols;
+    int bands;
+    // tiles of every band
+    int band_tiles;
+    int extent;
+    size_t max_shifts;
+    // for every band, the index among its computed shifts of each shift, -1 for those not computed yet
+    std::vector<int> slot_of_shift;
+    // shifts computed in every band
+    std::vector<int> used;
+    // tile costs of the computed shifts, max_shifts planes of band_tiles costs per band
+    std::vector<uint32_t> planes;
+    // scratch buffer reused by every band
+    std::vector<uint32_t> profile;
+};
+
+#endif //COST_VOLUME_H
@@ -0,0 +1,181 @@
+//
+// Patch SADs between two views of a light field read from per-shift summed-area tables.
+//
+
+#ifndef INTEGRAL_COSTS_H
+#define INTEGRAL_COSTS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include "lightfield.h"
+
+// memory budget of the summed-area tables of all the IntegralCosts alive at once (one per search direction of every
+// view being matched)
+constexpr size_t integral_costs_max_bytes = size_t(256) << 20;
+
+inline void integral_image(const std::vector<uint16_t> &values, int height, int width, std::vector<uint32_t> &sums) {
+    /* Summed-area table of a height x width image, with a leading row and column of zeros so that the sum over
+       rows [r0, r1) and columns [c0, c1) is sums[r1][c1] - sums[r0][c1] - sums[r1][c0] + sums[r0][c0].
+       The sums are allowed to wrap around: the difference of the four wrapped values is still exact as long as
+       the box itself fits in 32 bits. */
+    sums.assign(static_cast<size_t>(height + 1) * (width + 1), 0);
+    for (int r = 0; r < height; r++) {
+        uint32_t row_sum = 0;
+        const uint16_t *value = &values[static_cast<size_t>(r) * width];
+        const uint32_t *above = &sums[static_cast<size_t>(r) * (width + 1)];
+        uint32_t *current = &sums[static_cast<size_t>(r + 1) * (width + 1)];
+        for (int c = 0; c < width; c++) {
+            row_sum += value[c];
+            current[c + 1] = above[c + 1] + row_sum;
+        }
+    }
+}
+
+class IntegralCosts {
+    /* SADs between patches of the reference view (i, j) and the same patches shifted along the epipolar line in
+       the target view (columns for views in the same row, rows for views in the same column).
+       For every shift the absolute differences of the whole view are turned into a summed-area table the first
+       time the shift is asked for, after which the SAD of any rectangle, including the clipped patches on the
+       image border, is four lookups whatever its size. The tables are kept in least-recently-used order, at most
+       one per shift the caller may ask for, so that a search going back and forth over its shifts never evicts
+       one it needs again. They are also held to integral_costs_max_bytes across every instance alive: once that
+       is used up, a new shift recycles the storage of the oldest table of the instance, each instance keeping at
+       least one table. The cache itself is two flat arrays sized once per instance, so a new table is the only
+       heap allocation a new shift makes. */
+public:
+    // `shifts` is the number of different shifts cost may be called with
+    IntegralCosts(const LightFieldView &grid, int i, int j, int view_row, int view_col, size_t shifts) :
+            grid(grid), i(i), j(j), view_row(view_row), view_col(view_col), vertical(view_col == j),
+            extent(vertical ? grid.height : grid.width), max_tables(std::max<size_t>(1, shifts)),
+            table_bytes(sizeof(uint32_t) * (grid.height + 1) * (grid.width + 1)), reserved(0), clock(0),
+            slot_of_shift(2 * extent + 1, -1), differences(static_cast<size_t>(grid.height) * grid.width) {
+        slots.reserve(max_tables);
+    }
+
+    ~IntegralCosts() {
+        resident_bytes() -= reserved;
+    }
+
+    IntegralCosts(const IntegralCosts &) = delete;
+
+    IntegralCosts &operator=(const IntegralCosts &) = delete;
+
+    // SAD between the rows x cols patch with top-left corner (start_row, start_col) in the reference view and the
+    // target patch `shift` pixels away. The shifted patch must lie inside the target view
+    uint32_t cost(int start_row, int start_col, int rows, int cols, int shift) {
+        const std::vector<uint32_t> &sums = table(shift);
+        size_t stride = grid.width + 1;
+        size_t top = start_row * stride;
+        size_t bottom = (start_row + rows) * stride;
+        return sums[bottom + start_col + cols] - sums[top + start_col + cols] -
+               sums[bottom + start_col] + sums[top + start_col];
+    }
+
+    // summed-area tables allocated by every instance so far, those recycled from an older shift left out
+    static size_t allocated_tables() {
+        return allocations();
+    }
+
+private:
+    struct Slot {
+        int shift;
+        // value of clock when the table was last used
+        uint64_t last_used;
+        std::vector<uint32_t> sums;
+    };
+
+    static std::atomic<size_t> &allocations() {
+        static std::atomic<size_t> tables(0);
+        return tables;
+    }
+
+    // bytes of the tables of every instance alive
+    static std::atomic<size_t> &resident_bytes() {
+        static std::atomic<size_t> bytes(0);
+        return bytes;
+    }
+
+    bool reserve() {
+        // room for one more table in the shared budget, which the first table of an instance always gets
+        size_t before = resident_bytes().fetch_add(table_bytes);
+        if (!slots.empty() and before + table_bytes > integral_costs_max_bytes) {
+            resident_bytes() -= table_bytes;
+            return false;
+        }
+        reserved += table_bytes;
+        return true;
+    }
+
+    const std::vector<uint32_t> &table(int shift) {
+        // the shifts the window can reach lie in (-extent, extent)
+        int &slot = slot_of_shift[shift + extent];
+        if (slot < 0) {
+            if (slots.size() < max_tables and reserve()) {
+                slots.push_back({shift, 0, {}});
+                allocations()++;
+                slot = (int) slots.size() - 1;
+            } else {
+                // recycle the storage of the least recently used table, a scan that is nothing next to computing one
+                size_t oldest = 0;
+                for (size_t s = 1; s < slots.size(); s++) {
+                    if (slots[s].last_used < slots[oldest].last_used) {
+                        oldest = s;
+                    }
+                }
+                slot_of_shift[slots[oldest].shift + extent] = -1;
+                slots[oldest].shift = shift;
+                slot = (int) oldest;
+            }
+            compute_table(shift, slots[slot].sums);
+        }
+        slots[slot].last_used = ++clock;
+        return slots[slot].sums;
+    }
+
+    void compute_table(int shift, std::vector<uint32_t> &sums) {
+        // absolute differences summed over the channels (at most 255 * channels), zero where the shifted pixel
+        // falls outside of the target view
+        std::fill(differences.begin(), differences.end(), 0);
+        int row_shift = vertical ? shift : 0;
+        int col_shift = vertical ? 0 : shift;
+        int first_row = std::max(0, -row_shift);
+        int last_row = std::min(grid.height, grid.height - row_shift);
+        int first_col = std::max(0, -col_shift);
+        int last_col = std::min(grid.width, grid.width - col_shift);
+        for (int c = 0; c < grid.channels; c++) {
+            for (int r = first_row; r < last_row; r++) {
+                const uint8_t *reference = grid.row(i, j, c, r);
+                const uint8_t *target = grid.row(view_row, view_col, c, r + row_shift) + col_shift;
+                uint16_t *difference = &differences[static_cast<size_t>(r) * grid.width];
+                for (int m = first_col; m < last_col; m++) {
+                    difference[m] += static_cast<uint16_t>(abs(target[m] - reference[m]));
+                }
+            }
+        }
+        integral_image(differences, grid.height, grid.width, sums);
+    }
+
+    const LightFieldView &grid;
+    int i;
+    int j;
+    int view_row;
+    int view_col;
+    bool vertical;
+    int extent;
+    size_t max_tables;
+    size_t table_bytes;
+    // bytes this instance holds of the shared budget
+    size_t reserved;
+    uint64_t clock;
+    // index in slots of the table of every shift, -1 for those not cached
+    std::vector<int> slot_of_shift;
+    // the cached tables, at most max_tables
+    std::vector<Slot> slots;
+    // scratch buffer reused by every table
+    std::vector<uint16_t> differences;
+};
+
+#endif //INTEGRAL_COSTS_H
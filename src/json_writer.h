@@ -0,0 +1,132 @@
+//
+// Minimal streaming JSON writer, for the machine-readable reports of the benchmarks and of the timings.
+//
+
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+class JsonWriter {
+    /* Appends objects, arrays and values to a string, keeping track of the nesting so that the commas between
+       the elements go where they belong. Keys and string values are escaped, and numbers that JSON cannot hold
+       (NaN, infinities) are written as null. */
+public:
+    JsonWriter() : after_key(false) {}
+
+    JsonWriter &begin_object() {
+        return open('{');
+    }
+
+    JsonWriter &end_object() {
+        return close('}');
+    }
+
+    JsonWriter &begin_array() {
+        return open('[');
+    }
+
+    JsonWriter &end_array() {
+        return close(']');
+    }
+
+    JsonWriter &key(const std::string &name) {
+        separate();
+        write_string(name);
+        out += ':';
+        after_key = true;
+        return *this;
+    }
+
+    JsonWriter &value(const std::string &text) {
+        separate();
+        write_string(text);
+        return *this;
+    }
+
+    JsonWriter &value(const char *text) {
+        return value(std::string(text));
+    }
+
+    template<typename T>
+    std::enable_if_t<std::is_arithmetic_v<T>, JsonWriter &> value(T number) {
+        separate();
+        if constexpr (std::is_same_v<T, bool>) {
+            out += number ? "true" : "false";
+        } else if constexpr (std::is_integral_v<T>) {
+            out += std::to_string(number);
+        } else if (std::isfinite(number)) {
+            char buffer[32];
+            snprintf(buffer, sizeof(buffer), "%.9g", (double) number);
+            out += buffer;
+        } else {
+            out += "null";
+        }
+        return *this;
+    }
+
+    template<typename T>
+    JsonWriter &field(const std::string &name, const T &content) {
+        return key(name).value(content);
+    }
+
+    const std::string &str() const {
+        return out;
+    }
+
+private:
+    JsonWriter &open(char bracket) {
+        separate();
+        out += bracket;
+        first.push_back(true);
+        return *this;
+    }
+
+    JsonWriter &close(char bracket) {
+        out += bracket;
+        first.pop_back();
+        return *this;
+    }
+
+    void separate() {
+        // a value right after its key, or the first element of its container, needs no comma
+        if (after_key) {
+            after_key = false;
+            return;
+        }
+        if (!first.empty()) {
+            if (!first.back()) {
+                out += ',';
+            }
+            first.back() = false;
+        }
+    }
+
+    void write_string(const std::string &text) {
+        out += '"';
+        for (char c: text) {
+            if (c == '"' or c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char buffer[8];
+                snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                out += buffer;
+            } else {
+                out += c;
+            }
+        }
+        out += '"';
+    }
+
+    std::string out;
+    // for every open container, whether nothing was written to it yet
+    std::vector<bool> first;
+    bool after_key;
+};
+
+#endif //JSON_WRITER_H
@@ -0,0 +1,135 @@
+//
+// Contiguous storage for a grid of planar uint8 views.
+//
+
+#ifndef LIGHTFIELD_H
+#define LIGHTFIELD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+
+// minimal allocator returning storage aligned to `Alignment` bytes, so that every row of a
+// LightField starts on a cache line (and on a full vector register)
+template<typename T, size_t Alignment>
+struct AlignedAllocator {
+    typedef T value_type;
+
+    template<typename U>
+    struct rebind {
+        typedef AlignedAllocator<U, Alignment> other;
+    };
+
+    AlignedAllocator() = default;
+
+    template<typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+    T *allocate(size_t n) {
+        return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+
+    void deallocate(T *p, size_t) {
+        ::operator delete(p, std::align_val_t(Alignment));
+    }
+
+    template<typename U>
+    bool operator==(const AlignedAllocator<U, Alignment> &) const { return true; }
+
+    template<typename U>
+    bool operator!=(const AlignedAllocator<U, Alignment> &) const { return false; }
+};
+
+struct LightField {
+    /* A grid_rows x grid_cols grid of views, each with `channels` planes of height x width pixels,
+       held in a single allocation. The layout is view -> channel -> row -> col, and every row is
+       padded to `pitch` bytes (a multiple of row_alignment) so rows start aligned. */
+    static constexpr size_t row_alignment = 64;
+
+    LightField() : grid_rows(0), grid_cols(0), channels(0), height(0), width(0),
+                   pitch(0), channel_stride(0), view_stride(0) {}
+
+    LightField(int _grid_rows, int _grid_cols, int _channels, int _height, int _width) :
+            grid_rows(_grid_rows), grid_cols(_grid_cols), channels(_channels), height(_height), width(_width) {
+        pitch = (static_cast<size_t>(width) + row_alignment - 1) / row_alignment * row_alignment;
+        channel_stride = pitch * height;
+        view_stride = channel_stride * channels;
+        data.resize(view_stride * grid_rows * grid_cols);
+    }
+
+    uint8_t *row(int view_row, int view_col, int channel, int r) {
+        return &data[(view_row * grid_cols + view_col) * view_stride + channel * channel_stride + r * pitch];
+    }
+
+    const uint8_t *row(int view_row, int view_col, int channel, int r) const {
+        return &data[(view_row * grid_cols + view_col) * view_stride + channel * channel_stride + r * pitch];
+    }
+
+    uint8_t &at(int view_row, int view_col, int channel, int r, int c) {
+        return row(view_row, view_col, channel, r)[c];
+    }
+
+    uint8_t at(int view_row, int view_col, int channel, int r, int c) const {
+        return row(view_row, view_col, channel, r)[c];
+    }
+
+    int grid_rows;
+    int grid_cols;
+    int channels;
+    int height;
+    int width;
+    size_t pitch;
+    size_t channel_stride;
+    size_t view_stride;
+    std::vector<uint8_t, AlignedAllocator<uint8_t, row_alignment>> data;
+    // optional coarser copies of the whole grid, each at half the resolution of the previous one
+    std::vector<LightField> pyramid;
+};
+
+struct LightFieldView {
+    /* Non-owning, read-only view of a grid of planar views. Each view only needs to share the shape and strides
+       of the others, not the allocation, so copying a LightFieldView costs one pointer per view regardless of how
+       many pixels the light field holds. */
+    LightFieldView() : grid_rows(0), grid_cols(0), channels(0), height(0), width(0),
+                       pitch(0), channel_stride(0) {}
+
+    LightFieldView(const LightField &field) :
+            grid_rows(field.grid_rows), grid_cols(field.grid_cols), channels(field.channels),
+            height(field.height), width(field.width), pitch(field.pitch), channel_stride(field.channel_stride),
+            views(static_cast<size_t>(field.grid_rows) * field.grid_cols) {
+        for (size_t v = 0; v < views.size(); v++) {
+            views[v] = field.data.data() + v * field.view_stride;
+        }
+        for (const auto &level: field.pyramid) {
+            pyramid.emplace_back(level);
+        }
+    }
+
+    // views held elsewhere, one pointer to the first row of the first channel of each, in row-major view order
+    LightFieldView(int _grid_rows, int _grid_cols, int _channels, int _height, int _width, size_t _pitch,
+                   size_t _channel_stride, std::vector<const uint8_t *> _views) :
+            grid_rows(_grid_rows), grid_cols(_grid_cols), channels(_channels), height(_height), width(_width),
+            pitch(_pitch), channel_stride(_channel_stride), views(std::move(_views)) {}
+
+    const uint8_t *row(int view_row, int view_col, int channel, int r) const {
+        return views[view_row * grid_cols + view_col] + channel * channel_stride + r * pitch;
+    }
+
+    uint8_t at(int view_row, int view_col, int channel, int r, int c) const {
+        return row(view_row, view_col, channel, r)[c];
+    }
+
+    int grid_rows;
+    int grid_cols;
+    int channels;
+    int height;
+    int width;
+    size_t pitch;
+    size_t channel_stride;
+    std::vector<const uint8_t *> views;
+    std::vector<LightFieldView> pyramid;
+};
+
+#endif //LIGHTFIELD_H
@@ -0,0 +1,317 @@
+//
+// PatchMatchEngine, the entry point of the patchmatch library, over the matching and assembly of utils.cpp.
+//
+
+#include <optional>
+#include <type_traits>
+#include "utils.cpp"
+
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
+
+template<typename Work>
+auto in_parallel(int threads, Work work) -> decltype(work()) {
+    /* Run work on a single thread of a parallel region, from which it spreads over OpenMP tasks: the region of the
+       caller when there is one (even of a single thread), so that its tasks join that team, or else a region of
+       `threads` threads (all of them for 0), out of which an exception of work is rethrown to the caller. */
+    typedef decltype(work()) Result;
+#ifdef _OPENMP
+    if (omp_get_level() == 0) {
+        int team = threads > 0 ? threads : omp_get_max_threads();
+        TaskErrors errors;
+        if constexpr (is_void_v<Result>) {
+            #pragma omp parallel num_threads(team) default(none) shared(work, errors)
+            #pragma omp single
+            errors.run([&] {
+                work();
+            });
+            errors.rethrow();
+            return;
+        } else {
+            optional<Result> result;
+            #pragma omp parallel num_threads(team) default(none) shared(work, result, errors)
+            #pragma omp single
+            errors.run([&] {
+                result.emplace(work());
+            });
+            errors.rethrow();
+            return move(*result);
+        }
+    }
+#endif
+    return work();
+}
+
+vector<filesystem::directory_entry> scene_views(const string &scene_dir, int grid_rows, int grid_cols) {
+    vector<filesystem::directory_entry> files = get_scene_files(scene_dir, grid_rows, grid_cols);
+    if (files.empty()) {
+        throw runtime_error("no view of the " + to_string(grid_rows) + "x" + to_string(grid_cols) + " grid in " +
+                            scene_dir);
+    }
+    return files;
+}
+
+PatchMatchEngine::PatchMatchEngine(const EngineOptions &options) : settings(options) {
+    if (settings.patch_size < 1 or settings.stride < 1 or settings.roi < 0) {
+        throw invalid_argument("patch_size and stride must be positive, and roi not negative");
+    }
+    if (settings.num_similar < 0 or settings.num_similar > max_similar) {
+        throw invalid_argument("num_similar must be between 0 and " + to_string(max_similar));
+    }
+    if (!match_mode_available(settings.mode)) {
+        throw invalid_argument("the cost_volume mode is only built with the PATCHMATCH_COST_VOLUME option");
+    }
+}
+
+LightField PatchMatchEngine::load_scene(const string &scene_dir, int grid_rows, int grid_cols) const {
+    vector<filesystem::directory_entry> files = scene_views(scene_dir, grid_rows, grid_cols);
+    cv::Mat first = decode_view(files[0].path().string());
+    LightField scene_grid = allocate_scene_grid(grid_rows, grid_cols, first.rows, first.cols, pyramid_levels());
+    in_parallel(settings.threads, [&] {
+        load_views(scene_grid, files, first, [](int, int) {});
+    });
+    return scene_grid;
+}
+
+LightFieldView PatchMatchEngine::wrap_views(int grid_rows,
+                                            int grid_cols,
+                                            int height,
+                                            int width,
+                                            size_t pitch,
+                                            const vector<const uint8_t *> &views) {
+    if (views.size() != static_cast<size_t>(grid_rows) * grid_cols or pitch < static_cast<size_t>(width)) {
+        throw invalid_argument("expected one buffer per view, with rows of at least width bytes");
+    }
+    LightFieldView scene = LightFieldView(grid_rows, grid_cols, 3, height, width, pitch, pitch * height, views);
+    build_pyramid(scene);
+    return scene;
+}
+
+LightFieldView PatchMatchEngine::import_views(int grid_rows,
+                                              int grid_cols,
+                                              int height,
+                                              int width,
+                                              const vector<const uint8_t *> &views) {
+    if (views.size() != static_cast<size_t>(grid_rows) * grid_cols) {
+        throw invalid_argument("expected one buffer per view");
+    }
+    // the storage of the previous import is reused when the grid has the same shape
+    if (imported.grid_rows != grid_rows or imported.grid_cols != grid_cols or imported.height != height or
+        imported.width != width or imported.pyramid.size() != static_cast<size_t>(pyramid_levels())) {
+        imported = allocate_scene_grid(grid_rows, grid_cols, height, width, pyramid_levels());
+    }
+    LightField &grid = imported;
+    in_parallel(settings.threads, [&] {
+        // one task per view, splitting the interleaved pixels into the planes of the grid
+        #pragma omp taskloop default(none) grainsize(1) shared(grid, views)
+        for (size_t v = 0; v < views.size(); v++) {
+            int i = (int) v / grid.grid_cols;
+            int j = (int) v % grid.grid_cols;
+            ProfileScope scope(Phase::colour_conversion, i, j);
+            for (int c = 0; c < 3; c++) {
+                for (int r = 0; r < grid.height; r++) {
+                    const uint8_t *source = views[v] + static_cast<size_t>(r) * grid.width * 3 + c;
+                    uint8_t *destination = grid.row(i, j, c, r);
+                    for (int m = 0; m < grid.width; m++) {
+                        destination[m] = source[3 * m];
+                    }
+                }
+            }
+            for (size_t level = 0; level < grid.pyramid.size(); level++) {
+                downsample_view(level == 0 ? grid : grid.pyramid[level - 1], grid.pyramid[level], i, j);
+            }
+        }
+    });
+    return LightFieldView(imported);
+}
+
+void PatchMatchEngine::build_pyramid(LightFieldView &scene) {
+    int levels = pyramid_levels();
+    if (wrapped_pyramid.size() != static_cast<size_t>(levels) or
+        (levels > 0 and (wrapped_pyramid[0].grid_rows != scene.grid_rows or
+                         wrapped_pyramid[0].grid_cols != scene.grid_cols or
+                         wrapped_pyramid[0].height != (scene.height + 1) / 2 or
+                         wrapped_pyramid[0].width != (scene.width + 1) / 2))) {
+        wrapped_pyramid = allocate_scene_grid(scene.grid_rows, scene.grid_cols, scene.height, scene.width,
+                                              levels).pyramid;
+    }
+    vector<LightField> &pyramid = wrapped_pyramid;
+    in_parallel(settings.threads, [&] {
+        #pragma omp taskloop default(none) grainsize(1) shared(scene, pyramid)
+        for (size_t v = 0; v < scene.views.size(); v++) {
+            int i = (int) v / scene.grid_cols;
+            int j = (int) v % scene.grid_cols;
+            for (size_t level = 0; level < pyramid.size(); level++) {
+                if (level == 0) {
+                    downsample_view(scene, pyramid[0], i, j);
+                } else {
+                    downsample_view(pyramid[level - 1], pyramid[level], i, j);
+                }
+            }
+        }
+    });
+    scene.pyramid.assign(pyramid.begin(), pyramid.end());
+}
+
+ViewMatches PatchMatchEngine::match(const LightFieldView &scene, int i, int j) const {
+    return in_parallel(settings.threads, [&] {
+        return match_view(scene, i, j, settings.patch_size, settings.num_similar, settings.stride, settings.roi,
+                          settings.mode, settings.iterations);
+    });
+}
+
+MatchQuality PatchMatchEngine::compare_with_exhaustive(const LightFieldView &scene,
+                                                       int i,
+                                                       int j,
+                                                       const ViewMatches &matches) const {
+    MatchQuality quality;
+    ViewMatches exhaustive = in_parallel(settings.threads, [&] {
+        return match_view(scene, i, j, settings.patch_size, settings.num_similar, settings.stride, settings.roi);
+    });
+    compare_matches(scene, i, j, settings.patch_size, matches, exhaustive, quality);
+    return quality;
+}
+
+Frankenpatches PatchMatchEngine::frankenpatches(const LightFieldView &scene, int i, int j) const {
+    return in_parallel(settings.threads, [&] {
+        return assemble_frankenpatches(scene, i, j, settings.patch_size, settings.num_similar,
+                                       match_view(scene, i, j, settings.patch_size, settings.num_similar,
+                                                  settings.stride, settings.roi, settings.mode,
+                                                  settings.iterations));
+    });
+}
+
+Frankenpatches PatchMatchEngine::frankenpatches(const LightFieldView &scene,
+                                                int i,
+                                                int j,
+                                                const ViewMatches &matches) const {
+    return in_parallel(settings.threads, [&] {
+        return assemble_frankenpatches(scene, i, j, settings.patch_size, settings.num_similar, matches);
+    });
+}
+
+vector<Frankenpatches> PatchMatchEngine::frankenpatches(const LightFieldView &scene) const {
+    vector<optional<Frankenpatches>> outputs(scene.views.size());
+    const PatchMatchEngine &engine = *this;
+    in_parallel(settings.threads, [&] {
+        // one task per view, each splitting into tasks over its own tiles, as in process_scene. A view that fails is
+        // only reported once the others are done, as an exception cannot leave a task
+        TaskErrors errors;
+        #pragma omp taskgroup
+        for (size_t v = 0; v < outputs.size(); v++) {
+            #pragma omp task default(none) firstprivate(v) shared(engine, scene, outputs, errors)
+            errors.run([&] {
+                outputs[v].emplace(engine.frankenpatches(scene, (int) v / scene.grid_cols,
+                                                         (int) v % scene.grid_cols));
+            });
+        }
+        errors.rethrow();
+    });
+    vector<Frankenpatches> views;
+    views.reserve(outputs.size());
+    for (auto &output: outputs) {
+        views.push_back(move(*output));
+    }
+    return views;
+}
+
+void PatchMatchEngine::write(const LightFieldView &scene,
+                             int i,
+                             int j,
+                             const ViewMatches &matches,
+                             OutputFormat format,
+                             const string &filename,
+                             AsyncWriter &writer) const {
+    in_parallel(settings.threads, [&] {
+        if (format == OutputFormat::mmap) {
+            // the patches are assembled in the mapped file, which is then written back before it is unmapped, so
+            // that an error of the writeback is reported here
+            assemble_frankenpatches(scene, i, j, settings.patch_size, settings.num_similar, matches, filename)
+                    .file.close();
+        } else if (format == OutputFormat::matches) {
+            // only the table, the pixels can be read back from the views with load_matches and reconstruct
+            save_match_table(make_match_table(scene, i, j, settings.patch_size, settings.num_similar, matches),
+                             filename, writer);
+        } else if (format == OutputFormat::npz) {
+            // one member per row of tiles
+            save_compressed(assemble_frankenpatches(scene, i, j, settings.patch_size, settings.num_similar, matches),
+                            filename, settings.patch_size, writer);
+        } else {
+            // hand the patches over to the writer, and go back to matching
+            save_data(assemble_frankenpatches(scene, i, j, settings.patch_size, settings.num_similar, matches),
+                      filename, writer);
+        }
+    });
+}
+
+MatchTable PatchMatchEngine::load_matches(const string &filename) const {
+    return load_match_table(filename);
+}
+
+Frankenpatches PatchMatchEngine::reconstruct(const LightFieldView &scene, const MatchTable &table) const {
+    return in_parallel(settings.threads, [&] {
+        return reconstruct_frankenpatches(scene, table);
+    });
+}
+
+void PatchMatchEngine::reconstruct(const LightFieldView &scene,
+                                   const MatchTable &table,
+                                   int tile_row,
+                                   int tile_col,
+                                   Frankenpatches &output) const {
+    if (table.height != scene.height or table.width != scene.width) {
+        throw invalid_argument("the match table is of a view of another size");
+    }
+    if (output.height != table.height or output.width != table.width or output.channels != 3 * table.matches) {
+        throw invalid_argument("the output is not of the shape of the frankenpatches of the match table");
+    }
+    if (tile_row < 0 or tile_row >= table.tile_rows or tile_col < 0 or tile_col >= table.tile_cols) {
+        throw invalid_argument("no tile (" + to_string(tile_row) + ", " + to_string(tile_col) + ") in the table");
+    }
+    check_tile(scene, table, tile_row, tile_col);
+    reconstruct_tile(scene, table, tile_row, tile_col, output);
+}
+
+size_t PatchMatchEngine::process_scene(const string &scene_dir,
+                                       int grid_rows,
+                                       int grid_cols,
+                                       size_t max_memory,
+                                       const ViewCallback &on_view) const {
+    // get the views of the grid, and allocate the scene with the size of the first one
+    vector<filesystem::directory_entry> files = scene_views(scene_dir, grid_rows, grid_cols);
+    cv::Mat first = decode_view(files[0].path().string());
+    auto compute = [&](const LightFieldView &scene, int i, int j) {
+        int64_t start = Profiler::global().now();
+        ViewMatches matches = match_view(scene, i, j, settings.patch_size, settings.num_similar, settings.stride,
+                                         settings.roi, settings.mode, settings.iterations);
+        on_view(scene, i, j, move(matches));
+        // from the start of the matching to the return of on_view (for the command line, the hand-off of the output)
+        Profiler::global().record_view(scene_dir, i, j, start, Profiler::global().now());
+    };
+
+    return in_parallel(settings.threads, [&]() -> size_t {
+        if (max_memory > 0) {
+            // bounded-memory mode: only the rows and columns of the views being matched are kept in memory
+            return stream_views(files, grid_rows, grid_cols, first.rows, first.cols, pyramid_levels(), max_memory,
+                                compute);
+        }
+        LightField scene_grid = allocate_scene_grid(grid_rows, grid_cols, first.rows, first.cols, pyramid_levels());
+        // everything downstream only reads the views, so hand out a non-owning view instead of the storage itself
+        LightFieldView scene(scene_grid);
+
+        // the views are decoded in parallel, and each view becomes a task as soon as the views of its row and column
+        // are resident. That task in turn splits into tasks over its rows of tiles (or its search directions), so the
+        // threads stay busy even when there are fewer views than threads or the views take uneven times
+        // a view that fails is only reported once the others are done, as an exception cannot leave a task
+        TaskErrors errors;
+        load_views(scene_grid, files, first, [&](int i, int j) {
+            #pragma omp task firstprivate(i, j) shared(scene, compute, errors)
+            errors.run([&] {
+                compute(scene, i, j);
+            });
+        });
+        errors.rethrow();
+        return 0;
+    });
+}
@@ -0,0 +1,254 @@
+//
+// Public interface of the patchmatch library: scene loading, matching of views held in memory, and frankenpatches.
+//
+
+#ifndef PATCHMATCH_H
+#define PATCHMATCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "async_writer.h"
+#include "cnpy.h"
+#include "lightfield.h"
+#include "top_matches.h"
+
+enum class MatchMode {
+    // SAD of every candidate in the search window
+    exhaustive,
+    // candidates are accumulated a few rows at a time and dropped once they can no longer beat the current best
+    incremental,
+    // whole-view mode: the costs of every tile are read from a cost volume built once per pair of views. Only built
+    // with the PATCHMATCH_COST_VOLUME option, and rejected otherwise (see match_mode_available)
+    cost_volume,
+    // whole-view mode: the costs of every patch are read from per-shift summed-area tables of each pair of views
+    integral,
+    // coarse-to-fine search over the pyramid of the scene, refined with a small roi at every finer level
+    pyramid,
+    // whole-view mode: PatchMatch random search and propagation instead of a scan of the search window
+    patchmatch
+};
+
+inline MatchMode parse_match_mode(const std::string &name) {
+    if (name == "exhaustive") {
+        return MatchMode::exhaustive;
+    }
+    if (name == "incremental") {
+        return MatchMode::incremental;
+    }
+    if (name == "cost_volume") {
+        return MatchMode::cost_volume;
+    }
+    if (name == "integral") {
+        return MatchMode::integral;
+    }
+    if (name == "pyramid") {
+        return MatchMode::pyramid;
+    }
+    if (name == "patchmatch") {
+        return MatchMode::patchmatch;
+    }
+    throw std::invalid_argument("unknown matching mode: " + name);
+}
+
+// whether this build of the library runs the mode, which is not the case of cost_volume without the
+// PATCHMATCH_COST_VOLUME build option
+bool match_mode_available(MatchMode mode);
+
+enum class OutputFormat {
+    // .npy files written by the background writer
+    npy,
+    // .npy files mapped in memory, the frankenpatches being assembled straight into them
+    mmap,
+    // .npz archives with one deflated member per row of tiles, so a tile can be read without inflating the rest
+    npz,
+    // the match table of every view (see MatchTable) instead of its pixels
+    matches
+};
+
+inline OutputFormat parse_output_format(const std::string &name) {
+    if (name == "npy") {
+        return OutputFormat::npy;
+    }
+    if (name == "mmap") {
+        return OutputFormat::mmap;
+    }
+    if (name == "npz") {
+        return OutputFormat::npz;
+    }
+    if (name == "matches") {
+        return OutputFormat::matches;
+    }
+    throw std::invalid_argument("unknown output format: " + name);
+}
+
+struct Frankenpatches {
+    /* The stacked RGB planes of the matching patches of every tile of a view (the tile itself last), interleaved in
+       (H, W, C) order, which is the layout of the saved .npy arrays, so the buffer is written out as is. The pixels
+       are either held in memory or, to skip the write altogether, in a .npy file mapped in memory. */
+    Frankenpatches(int _height, int _width, int _channels) :
+            height(_height), width(_width), channels(_channels),
+            data(static_cast<size_t>(_height) * _width * _channels), pixels(data.data()) {}
+
+    // the .npy file is created (with its header) right away, and unmapped when the Frankenpatches are destroyed
+    Frankenpatches(int _height, int _width, int _channels, const std::string &filename) :
+            height(_height), width(_width), channels(_channels),
+            file(cnpy::npy_map_create<uint8_t>(filename, shape())), pixels(file.data<uint8_t>()) {}
+
+    uint8_t at(int r, int c, int k) const {
+        return pixels[(static_cast<size_t>(r) * width + c) * channels + k];
+    }
+
+    std::vector<size_t> shape() const {
+        return {static_cast<size_t>(height), static_cast<size_t>(width), static_cast<size_t>(channels)};
+    }
+
+    int height;
+    int width;
+    int channels;
+    // storage of the pixels, empty when they live in the mapped file instead
+    std::vector<uint8_t> data;
+    cnpy::NpyMap file;
+    uint8_t *pixels;
+};
+
+struct MatchTable {
+    /* Compact form of the frankenpatches of a view: for every tile, the num_similar + 1 patches it is made of (the
+       tile itself last) as {view_row, view_col, row, col, difference}, the difference being the mean absolute
+       difference with the tile (0 for the tile itself). The pixels are read back from the source views by
+       PatchMatchEngine::reconstruct, whole or tile by tile. */
+    static constexpr int fields = 5;
+
+    MatchTable(int _height, int _width, int _patch_size, int _matches) :
+            height(_height), width(_width), patch_size(_patch_size), matches(_matches),
+            tile_rows((_height + _patch_size - 1) / _patch_size), tile_cols((_width + _patch_size - 1) / _patch_size),
+            entries(static_cast<size_t>(tile_rows) * tile_cols * _matches * fields) {}
+
+    uint16_t *entry(int tile_row, int tile_col, int k) {
+        return &entries[((static_cast<size_t>(tile_row) * tile_cols + tile_col) * matches + k) * fields];
+    }
+
+    const uint16_t *entry(int tile_row, int tile_col, int k) const {
+        return &entries[((static_cast<size_t>(tile_row) * tile_cols + tile_col) * matches + k) * fields];
+    }
+
+    int height;
+    int width;
+    int patch_size;
+    int matches;
+    int tile_rows;
+    int tile_cols;
+    std::vector<uint16_t> entries;
+};
+
+struct MatchQuality {
+    /* Running totals comparing the matches of an approximate mode with those of the exhaustive search, so that
+       the results of several views can be accumulated */
+    long matches = 0;
+    // matches also found by the exhaustive search
+    long identical = 0;
+    // summed normalised L1 difference of the matches of each search
+    double difference = 0;
+    double exhaustive_difference = 0;
+};
+
+struct EngineOptions {
+    // the positional arguments of the command line, with the same defaults
+    int patch_size = 8;
+    int num_similar = 4;
+    int stride = 1;
+    int roi = 3;
+    MatchMode mode = MatchMode::exhaustive;
+    // coarser levels of the pyramid mode, and iterations of the patchmatch mode
+    int pyramid_levels = 2;
+    int iterations = 4;
+    // threads of the parallel regions the engine opens itself, 0 for the OpenMP default
+    int threads = 0;
+};
+
+class PatchMatchEngine {
+    /* Matching and frankenpatches of light fields, either loaded from a scene directory or held in memory by the
+       caller, with one set of options. The parallel work runs on the threads of the OpenMP runtime, which keeps them
+       (and with them the per-thread scratch arenas of the tile loops) from one call to the next, and the storage of
+       imported views is reused as long as the shape of the grid does not change, so a long-lived engine does not
+       set anything up again per scene. Called from outside of a parallel region, every method opens its own; called
+       from a single thread of one (as the command line does for its scene tasks), it spreads its work over OpenMP
+       tasks of that region instead. A method taking a LightFieldView may be called concurrently on the same engine,
+       but wrap_views and import_views may not. */
+public:
+    // called with every view of a scene as soon as it is matched, while the other views are still being matched
+    typedef std::function<void(const LightFieldView &scene, int i, int j, ViewMatches &&matches)> ViewCallback;
+
+    explicit PatchMatchEngine(const EngineOptions &options = EngineOptions());
+
+    const EngineOptions &options() const {
+        return settings;
+    }
+
+    // the views of a scene directory, with the pyramid levels the matching mode needs
+    LightField load_scene(const std::string &scene_dir, int grid_rows, int grid_cols) const;
+
+    // views held by the caller, one planar buffer per view in row-major view order, each with its channels (RGB) one
+    // after the other and its rows `pitch` bytes apart. The buffers are not copied, and must outlive the returned
+    // view; only the pyramid of the pyramid mode is computed, into storage of the engine valid until the next wrap
+    LightFieldView wrap_views(int grid_rows, int grid_cols, int height, int width, size_t pitch,
+                              const std::vector<const uint8_t *> &views);
+
+    // views held by the caller as interleaved RGB images (height x width x 3, the layout of decoded images and of
+    // numpy arrays), copied into storage of the engine. The returned view is valid until the next import
+    LightFieldView import_views(int grid_rows, int grid_cols, int height, int width,
+                                const std::vector<const uint8_t *> &views);
+
+    ViewMatches match(const LightFieldView &scene, int i, int j) const;
+
+    // how the matches of the approximate modes compare with those of the exhaustive search
+    MatchQuality compare_with_exhaustive(const LightFieldView &scene, int i, int j, const ViewMatches &matches) const;
+
+    Frankenpatches frankenpatches(const LightFieldView &scene, int i, int j) const;
+
+    Frankenpatches frankenpatches(const LightFieldView &scene, int i, int j, const ViewMatches &matches) const;
+
+    // the frankenpatches of every view, in row-major view order, the views being matched in parallel
+    std::vector<Frankenpatches> frankenpatches(const LightFieldView &scene) const;
+
+    // write the output of a view in the given format, through the writer thread (except for mmap)
+    void write(const LightFieldView &scene, int i, int j, const ViewMatches &matches, OutputFormat format,
+               const std::string &filename, AsyncWriter &writer) const;
+
+    // the match table of a view written in the matches format, checked against what write produces
+    MatchTable load_matches(const std::string &filename) const;
+
+    // the frankenpatches a match table was made from, read back from the views of `scene`
+    Frankenpatches reconstruct(const LightFieldView &scene, const MatchTable &table) const;
+
+    // only the tile (tile_row, tile_col) of those frankenpatches, at its place in output (of the same shape)
+    void reconstruct(const LightFieldView &scene, const MatchTable &table, int tile_row, int tile_col,
+                     Frankenpatches &output) const;
+
+    /* Load a scene directory and match every view, calling on_view with each view as soon as it is matched. With a
+       max_memory in bytes, only the rows and columns of the views being matched are kept in memory, at the cost of
+       decoding some views several times. Returns the number of views decoded in that mode, 0 otherwise. */
+    size_t process_scene(const std::string &scene_dir, int grid_rows, int grid_cols, size_t max_memory,
+                         const ViewCallback &on_view) const;
+
+private:
+    int pyramid_levels() const {
+        return settings.mode == MatchMode::pyramid ? settings.pyramid_levels : 0;
+    }
+
+    // the pyramid levels of the views of `scene`, computed into wrapped_pyramid
+    void build_pyramid(LightFieldView &scene);
+
+    EngineOptions settings;
+    // storage of the imported views (with their pyramid), and of the pyramid of the wrapped ones
+    LightField imported;
+    std::vector<LightField> wrapped_pyramid;
+};
+
+// names of the views of a scene directory that fall inside the grid, sorted
+std::vector<std::string> get_scene_names(const std::string &scene_dir, int grid_size_0, int grid_size_1);
+
+#endif //PATCHMATCH_H
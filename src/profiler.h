@@ -0,0 +1,384 @@
+//
+// Per-phase timers and counters of a run, per thread, dumped as JSON or as a Chrome trace.
+//
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "json_writer.h"
+
+// the timers are compiled in unless the build sets PATCHMATCH_PROFILING to 0
+#ifndef PATCHMATCH_PROFILING
+    #define PATCHMATCH_PROFILING 1
+#endif
+
+// phases nest: decode and colour_conversion are part of load, and everything but load and write is part of view
+enum class Phase {
+    view,
+    load,
+    decode,
+    colour_conversion,
+    matching,
+    top_k,
+    assembly,
+    flatten,
+    write
+};
+constexpr int num_phases = 9;
+
+inline const char *phase_name(Phase phase) {
+    static const char *names[num_phases] = {"view", "load", "decode", "colour_conversion", "matching", "top_k",
+                                            "assembly", "flatten", "write"};
+    return names[static_cast<int>(phase)];
+}
+
+enum class Counter {
+    views_decoded,
+    tiles_matched,
+    // patches compared with a tile, whatever the search
+    candidates,
+    top_k_inserts,
+    files_written,
+    bytes_written
+};
+constexpr int num_counters = 6;
+
+inline const char *counter_name(Counter counter) {
+    static const char *names[num_counters] = {"views_decoded", "tiles_matched", "candidates", "top_k_inserts",
+                                              "files_written", "bytes_written"};
+    return names[static_cast<int>(counter)];
+}
+
+class Profiler {
+    /* Process-wide record of where the time goes. Every thread (the OpenMP threads and the writer) accumulates
+       its own time per phase and its own counters, without any synchronisation, so the timers can stay on in
+       production runs: the phases are only timed at the granularity of a view, a row of tiles or a search
+       direction, never per candidate. With tracing on, every timed interval is also kept, to be dumped as a Chrome
+       trace (chrome://tracing or Perfetto) showing what each thread did when. The latencies of the views are always
+       summed up, for the straggler views, in a histogram and a list of the slowest views whose size does not depend
+       on how many views a long-lived process goes through; with tracing on, every view is also kept for the trace.
+       The dumps are meant to be taken once all the work is done. */
+public:
+    struct Span {
+        Phase phase;
+        int view_row;
+        int view_col;
+        // search direction, row of tiles... -1 when it does not apply
+        int detail;
+        int64_t start;
+        int64_t end;
+    };
+
+    struct ViewLatency {
+        std::string scene;
+        int view_row;
+        int view_col;
+        int thread;
+        int64_t start;
+        int64_t end;
+    };
+
+    static Profiler &global() {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    Profiler(const Profiler &) = delete;
+
+    Profiler &operator=(const Profiler &) = delete;
+
+    void set_tracing(bool enabled) {
+        tracing = enabled;
+    }
+
+    // nanoseconds since the start of the process (of the first use of the profiler)
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    void record(Phase phase, int64_t start, int64_t end, int view_row = -1, int view_col = -1, int detail = -1) {
+        ThreadLog &log = local();
+        log.nanoseconds[static_cast<int>(phase)] += end - start;
+        log.calls[static_cast<int>(phase)]++;
+        if (tracing.load(std::memory_order_relaxed)) {
+            log.spans.push_back({phase, view_row, view_col, detail, start, end});
+        }
+    }
+
+    void count(Counter counter, uint64_t n) {
+        local().counters[static_cast<int>(counter)] += n;
+    }
+
+    void record_view(const std::string &scene, int view_row, int view_col, int64_t start, int64_t end) {
+        ThreadLog &log = local();
+        log.nanoseconds[static_cast<int>(Phase::view)] += end - start;
+        log.calls[static_cast<int>(Phase::view)]++;
+        ViewLatency view = {scene, view_row, view_col, log.index, start, end};
+        std::lock_guard<std::mutex> lock(mutex);
+        latencies.add(view.end - view.start);
+        // the slowest views so far, as a heap whose top is the fastest of them
+        auto faster = [](const ViewLatency &a, const ViewLatency &b) {
+            return a.end - a.start > b.end - b.start;
+        };
+        if (slowest.size() < slowest_views) {
+            slowest.push_back(view);
+            std::push_heap(slowest.begin(), slowest.end(), faster);
+        } else if (view.end - view.start > slowest.front().end - slowest.front().start) {
+            std::pop_heap(slowest.begin(), slowest.end(), faster);
+            slowest.back() = view;
+            std::push_heap(slowest.begin(), slowest.end(), faster);
+        }
+        if (tracing.load(std::memory_order_relaxed)) {
+            views.push_back(std::move(view));
+        }
+    }
+
+    // name of the calling thread in the dumps, "thread <n>" otherwise
+    void name_thread(const std::string &name) {
+        local().name = name;
+    }
+
+    std::string json() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        JsonWriter json;
+        json.begin_object();
+
+        // totals over every thread, then every thread on its own
+        json.key("phases").begin_object();
+        for (int p = 0; p < num_phases; p++) {
+            int64_t nanoseconds = 0;
+            uint64_t calls = 0;
+            for (const auto &log: logs) {
+                nanoseconds += log->nanoseconds[p];
+                calls += log->calls[p];
+            }
+            json.key(phase_name(static_cast<Phase>(p))).begin_object().field("ms", nanoseconds / 1e6)
+                    .field("calls", calls).end_object();
+        }
+        json.end_object();
+        json.key("counters").begin_object();
+        for (int c = 0; c < num_counters; c++) {
+            uint64_t total = 0;
+            for (const auto &log: logs) {
+                total += log->counters[c];
+            }
+            json.field(counter_name(static_cast<Counter>(c)), total);
+        }
+        json.end_object();
+        json.key("threads").begin_array();
+        for (const auto &log: logs) {
+            json.begin_object().field("thread", log->index).field("name", thread_name(*log));
+            json.key("phases_ms").begin_object();
+            for (int p = 0; p < num_phases; p++) {
+                json.field(phase_name(static_cast<Phase>(p)), log->nanoseconds[p] / 1e6);
+            }
+            json.end_object();
+            json.key("counters").begin_object();
+            for (int c = 0; c < num_counters; c++) {
+                json.field(counter_name(static_cast<Counter>(c)), log->counters[c]);
+            }
+            json.end_object().end_object();
+        }
+        json.end_array();
+
+        // per-view latencies: summary (the median and p90 to an eighth of an octave), histogram with power of two
+        // buckets, and the slowest views
+        json.key("views").begin_object().field("count", latencies.count);
+        json.key("latency_ms").begin_object().field("min", latencies.count ? latencies.min / 1e6 : 0.0)
+                .field("median", latencies.quantile(0.5)).field("p90", latencies.quantile(0.9))
+                .field("max", latencies.max / 1e6).end_object();
+        json.key("histogram").begin_array();
+        uint64_t counted = 0;
+        for (int octave = 0; counted < latencies.count; octave++) {
+            uint64_t below = latencies.below(octave * LatencyHistogram::steps);
+            json.begin_object().field("below_ms", std::ldexp(1.0, octave)).field("views", below - counted)
+                    .end_object();
+            counted = below;
+        }
+        json.end_array();
+        std::vector<ViewLatency> sorted = slowest;
+        std::sort(sorted.begin(), sorted.end(), [](const ViewLatency &a, const ViewLatency &b) {
+            return a.end - a.start > b.end - b.start;
+        });
+        json.key("slowest").begin_array();
+        for (const auto &view: sorted) {
+            json.begin_object().field("scene", view.scene).field("view_row", view.view_row)
+                    .field("view_col", view.view_col).field("thread", view.thread)
+                    .field("ms", (view.end - view.start) / 1e6).end_object();
+        }
+        json.end_array().end_object();
+
+        json.end_object();
+        return json.str();
+    }
+
+    std::string chrome_trace() const {
+        // complete events ("ph": "X") in microseconds, one track per thread
+        std::lock_guard<std::mutex> lock(mutex);
+        JsonWriter json;
+        json.begin_object().key("traceEvents").begin_array();
+        for (const auto &log: logs) {
+            json.begin_object().field("name", "thread_name").field("ph", "M").field("pid", 1)
+                    .field("tid", log->index).key("args").begin_object().field("name", thread_name(*log))
+                    .end_object().end_object();
+            for (const auto &span: log->spans) {
+                json.begin_object().field("name", phase_name(span.phase)).field("cat", "patchmatch")
+                        .field("ph", "X").field("ts", span.start / 1e3).field("dur", (span.end - span.start) / 1e3)
+                        .field("pid", 1).field("tid", log->index).key("args").begin_object();
+                if (span.view_row >= 0) {
+                    json.field("view_row", span.view_row).field("view_col", span.view_col);
+                }
+                if (span.detail >= 0) {
+                    json.field("detail", span.detail);
+                }
+                json.end_object().end_object();
+            }
+        }
+        for (const auto &view: views) {
+            json.begin_object().field("name", "view").field("cat", "patchmatch").field("ph", "X")
+                    .field("ts", view.start / 1e3).field("dur", (view.end - view.start) / 1e3).field("pid", 1)
+                    .field("tid", view.thread).key("args").begin_object().field("scene", view.scene)
+                    .field("view_row", view.view_row).field("view_col", view.view_col).end_object().end_object();
+        }
+        json.end_array().field("displayTimeUnit", "ms").end_object();
+        return json.str();
+    }
+
+private:
+    // number of views listed by name in the JSON dump
+    static constexpr size_t slowest_views = 10;
+
+    struct LatencyHistogram {
+        /* Number of views per latency, in `steps` buckets per octave from 2^-octaves ms (about a nanosecond) to
+           2^octaves ms (about 18 minutes): the upper bound of bucket b is 2^(b / steps - octaves) ms, so the bounds
+           of the whole milliseconds that are powers of two fall on bucket boundaries. */
+        static constexpr int steps = 8;
+        static constexpr int octaves = 20;
+        static constexpr int buckets = 2 * octaves * steps + 1;
+
+        void add(int64_t nanoseconds) {
+            double milliseconds = nanoseconds / 1e6;
+            int bucket = milliseconds <= 0 ? 0 : (int) std::floor(steps * (std::log2(milliseconds) + octaves)) + 1;
+            views[std::clamp(bucket, 0, buckets - 1)]++;
+            min = count == 0 ? nanoseconds : std::min(min, nanoseconds);
+            max = count == 0 ? nanoseconds : std::max(max, nanoseconds);
+            count++;
+        }
+
+        // views faster than 2^(bucket / steps) ms, the bucket counting from 1 ms
+        uint64_t below(int bucket) const {
+            uint64_t total = 0;
+            for (int b = 0; b < std::min(buckets, bucket + octaves * steps + 1); b++) {
+                total += views[b];
+            }
+            return total;
+        }
+
+        // the latency below which a fraction q of the views fall, as the upper bound of its bucket (exact at 0 and 1)
+        double quantile(double q) const {
+            if (count == 0) {
+                return 0;
+            }
+            uint64_t rank = std::min(count - 1, (uint64_t) (q * count));
+            uint64_t total = 0;
+            for (int b = 0; b < buckets; b++) {
+                total += views[b];
+                if (total > rank) {
+                    double bound = std::exp2((double) b / steps - octaves);
+                    return std::clamp(bound, min / 1e6, max / 1e6);
+                }
+            }
+            return max / 1e6;
+        }
+
+        uint64_t views[buckets] = {};
+        uint64_t count = 0;
+        int64_t min = 0;
+        int64_t max = 0;
+    };
+
+    struct ThreadLog {
+        int index = 0;
+        std::string name;
+        int64_t nanoseconds[num_phases] = {};
+        uint64_t calls[num_phases] = {};
+        uint64_t counters[num_counters] = {};
+        std::vector<Span> spans;
+    };
+
+    Profiler() : epoch(std::chrono::steady_clock::now()), tracing(false) {}
+
+    ThreadLog &local() {
+        // registered on the first use by each thread, and kept after the thread exits so the dumps still see it
+        thread_local ThreadLog *log = nullptr;
+        if (log == nullptr) {
+            std::lock_guard<std::mutex> lock(mutex);
+            logs.push_back(std::make_unique<ThreadLog>());
+            log = logs.back().get();
+            log->index = (int) logs.size() - 1;
+        }
+        return *log;
+    }
+
+    static std::string thread_name(const ThreadLog &log) {
+        return log.name.empty() ? "thread " + std::to_string(log.index) : log.name;
+    }
+
+    std::chrono::steady_clock::time_point epoch;
+    std::atomic<bool> tracing;
+    mutable std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadLog>> logs;
+    LatencyHistogram latencies;
+    // at most slowest_views, as a heap
+    std::vector<ViewLatency> slowest;
+    // every view, only with tracing on
+    std::vector<ViewLatency> views;
+};
+
+class ProfileScope {
+    // times the enclosing block as `phase` of the calling thread
+public:
+    // the arguments are unused in builds without PATCHMATCH_PROFILING
+    explicit ProfileScope([[maybe_unused]] Phase phase, [[maybe_unused]] int view_row = -1,
+                          [[maybe_unused]] int view_col = -1, [[maybe_unused]] int detail = -1)
+#if PATCHMATCH_PROFILING
+            : phase(phase), view_row(view_row), view_col(view_col), detail(detail), start(Profiler::global().now())
+#endif
+    {}
+
+    ~ProfileScope() {
+#if PATCHMATCH_PROFILING
+        Profiler::global().record(phase, start, Profiler::global().now(), view_row, view_col, detail);
+#endif
+    }
+
+    ProfileScope(const ProfileScope &) = delete;
+
+    ProfileScope &operator=(const ProfileScope &) = delete;
+
+#if PATCHMATCH_PROFILING
+private:
+    Phase phase;
+    int view_row;
+    int view_col;
+    int detail;
+    int64_t start;
+#endif
+};
+
+inline void profile_count([[maybe_unused]] Counter counter, [[maybe_unused]] uint64_t n) {
+#if PATCHMATCH_PROFILING
+    Profiler::global().count(counter, n);
+#endif
+}
+
+#endif //PROFILER_H
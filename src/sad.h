@@ -0,0 +1,260 @@
+//
+// Sum of absolute differences between two planar uint8 patches, with runtime dispatch between
+// scalar, SSE2, AVX2 and AVX-512BW implementations.
+//
+
+#ifndef SAD_H
+#define SAD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define SAD_X86 1
+#endif
+
+// sum of |target - reference| over `channels` planes of rows x cols pixels. Both patches share the row pitch and
+// the channel stride, which is always the case for two views of the same LightField
+typedef uint32_t (*sad_patch_fn)(const uint8_t *reference,
+                                 const uint8_t *target,
+                                 size_t pitch,
+                                 size_t channel_stride,
+                                 int channels,
+                                 int rows,
+                                 int cols);
+
+inline uint32_t sad_patch_scalar(const uint8_t *reference,
+                                 const uint8_t *target,
+                                 size_t pitch,
+                                 size_t channel_stride,
+                                 int channels,
+                                 int rows,
+                                 int cols) {
+    uint32_t difference = 0;
+    for (int c = 0; c < channels; c++) {
+        for (int l = 0; l < rows; l++) {
+            const uint8_t *a = reference + c * channel_stride + l * pitch;
+            const uint8_t *b = target + c * channel_stride + l * pitch;
+            for (int m = 0; m < cols; m++) {
+                difference += abs(b[m] - a[m]);
+            }
+        }
+    }
+    return difference;
+}
+
+#ifdef SAD_X86
+
+__attribute__((target("sse2")))
+inline uint32_t sad_patch_sse2(const uint8_t *reference,
+                               const uint8_t *target,
+                               size_t pitch,
+                               size_t channel_stride,
+                               int channels,
+                               int rows,
+                               int cols) {
+    // psadbw gives two partial sums (one per 8-byte half) in the low bits of each 64-bit lane
+    __m128i sum = _mm_setzero_si128();
+    uint32_t tail = 0;
+    for (int c = 0; c < channels; c++) {
+        for (int l = 0; l < rows; l++) {
+            const uint8_t *a = reference + c * channel_stride + l * pitch;
+            const uint8_t *b = target + c * channel_stride + l * pitch;
+            int m = 0;
+            for (; m + 16 <= cols; m += 16) {
+                __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + m));
+                __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + m));
+                sum = _mm_add_epi64(sum, _mm_sad_epu8(va, vb));
+            }
+            if (m + 8 <= cols) {
+                __m128i va = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(a + m));
+                __m128i vb = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(b + m));
+                sum = _mm_add_epi64(sum, _mm_sad_epu8(va, vb));
+                m += 8;
+            }
+            for (; m < cols; m++) {
+                tail += abs(b[m] - a[m]);
+            }
+        }
+    }
+    sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(sum)) + tail;
+}
+
+__attribute__((target("avx2")))
+inline uint32_t sad_patch_avx2(const uint8_t *reference,
+                               const uint8_t *target,
+                               size_t pitch,
+                               size_t channel_stride,
+                               int channels,
+                               int rows,
+                               int cols) {
+    __m256i sum = _mm256_setzero_si256();
+    __m128i sum_128 = _mm_setzero_si128();
+    uint32_t tail = 0;
+    for (int c = 0; c < channels; c++) {
+        for (int l = 0; l < rows; l++) {
+            const uint8_t *a = reference + c * channel_stride + l * pitch;
+            const uint8_t *b = target + c * channel_stride + l * pitch;
+            int m = 0;
+            for (; m + 32 <= cols; m += 32) {
+                __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + m));
+                __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + m));
+                sum = _mm256_add_epi64(sum, _mm256_sad_epu8(va, vb));
+            }
+            if (m + 16 <= cols) {
+                __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + m));
+                __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + m));
+                sum_128 = _mm_add_epi64(sum_128, _mm_sad_epu8(va, vb));
+                m += 16;
+            }
+            if (m + 8 <= cols) {
+                __m128i va = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(a + m));
+                __m128i vb = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(b + m));
+                sum_128 = _mm_add_epi64(sum_128, _mm_sad_epu8(va, vb));
+                m += 8;
+            }
+            for (; m < cols; m++) {
+                tail += abs(b[m] - a[m]);
+            }
+        }
+    }
+    sum_128 = _mm_add_epi64(sum_128, _mm256_castsi256_si128(sum));
+    sum_128 = _mm_add_epi64(sum_128, _mm256_extracti128_si256(sum, 1));
+    sum_128 = _mm_add_epi64(sum_128, _mm_unpackhi_epi64(sum_128, sum_128));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(sum_128)) + tail;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+inline uint32_t sad_patch_avx512bw(const uint8_t *reference,
+                                   const uint8_t *target,
+                                   size_t pitch,
+                                   size_t channel_stride,
+                                   int channels,
+                                   int rows,
+                                   int cols) {
+    // the masked load of the last partial chunk zeroes the lanes past `cols` in both rows, and masked-out
+    // lanes never fault, so there is no scalar tail and no over-read
+    __m512i sum = _mm512_setzero_si512();
+    int remainder = cols % 64;
+    __mmask64 mask = remainder ? (~0ULL >> (64 - remainder)) : 0;
+    for (int c = 0; c < channels; c++) {
+        for (int l = 0; l < rows; l++) {
+            const uint8_t *a = reference + c * channel_stride + l * pitch;
+            const uint8_t *b = target + c * channel_stride + l * pitch;
+            int m = 0;
+            for (; m + 64 <= cols; m += 64) {
+                __m512i va = _mm512_loadu_si512(a + m);
+                __m512i vb = _mm512_loadu_si512(b + m);
+                sum = _mm512_add_epi64(sum, _mm512_sad_epu8(va, vb));
+            }
+            if (remainder) {
+                __m512i va = _mm512_maskz_loadu_epi8(mask, a + m);
+                __m512i vb = _mm512_maskz_loadu_epi8(mask, b + m);
+                sum = _mm512_add_epi64(sum, _mm512_sad_epu8(va, vb));
+            }
+        }
+    }
+    alignas(64) uint64_t lanes[8];
+    _mm512_store_si512(lanes, sum);
+    return static_cast<uint32_t>(lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+                                 lanes[4] + lanes[5] + lanes[6] + lanes[7]);
+}
+
+#endif
+
+inline sad_patch_fn select_sad_patch() {
+    // pick the widest implementation the running CPU supports
+#ifdef SAD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512bw")) {
+        return sad_patch_avx512bw;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return sad_patch_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return sad_patch_sse2;
+    }
+#endif
+    return sad_patch_scalar;
+}
+
+inline const sad_patch_fn sad_patch = select_sad_patch();
+
+// number of rows accumulated between two checks of the bound in sad_patch_bounded
+constexpr int sad_bound_rows = 4;
+
+inline uint32_t sad_patch_bounded(const uint8_t *reference,
+                                  const uint8_t *target,
+                                  size_t pitch,
+                                  size_t channel_stride,
+                                  int channels,
+                                  int rows,
+                                  int cols,
+                                  uint32_t bound) {
+    /* Same as sad_patch, but accumulated a few rows at a time and abandoned as soon as the partial sum reaches
+       `bound`. The return value is then only guaranteed to be >= bound, which is all a caller looking for a
+       minimum needs to know. */
+    uint32_t difference = 0;
+    for (int l = 0; l < rows; l += sad_bound_rows) {
+        int block = rows - l < sad_bound_rows ? rows - l : sad_bound_rows;
+        difference += sad_patch(reference + l * pitch, target + l * pitch, pitch, channel_stride, channels,
+                                block, cols);
+        if (difference >= bound) {
+            break;
+        }
+    }
+    return difference;
+}
+
+template<int PatchSize, int Channels>
+inline uint32_t sad_patch_fixed(const uint8_t *reference,
+                                const uint8_t *target,
+                                size_t pitch,
+                                size_t channel_stride) {
+    /* Square PatchSize x PatchSize patch with a compile-time number of channels. All the loop bounds are constants,
+       so the loops are fully unrolled and there is no per-row tail handling. SSE2 is part of the x86-64 baseline,
+       so this does not need the runtime dispatch. */
+#ifdef SAD_X86
+    static_assert(PatchSize % 8 == 0, "fixed-size SAD kernels need patches a multiple of 8 pixels wide");
+    __m128i sum = _mm_setzero_si128();
+#pragma GCC unroll 4
+    for (int c = 0; c < Channels; c++) {
+        const uint8_t *a = reference + c * channel_stride;
+        const uint8_t *b = target + c * channel_stride;
+        if constexpr (PatchSize == 8) {
+            // two 8-pixel rows per register
+#pragma GCC unroll 4
+            for (int l = 0; l < PatchSize; l += 2) {
+                const __m128i *a0 = reinterpret_cast<const __m128i *>(a + l * pitch);
+                const __m128i *a1 = reinterpret_cast<const __m128i *>(a + (l + 1) * pitch);
+                const __m128i *b0 = reinterpret_cast<const __m128i *>(b + l * pitch);
+                const __m128i *b1 = reinterpret_cast<const __m128i *>(b + (l + 1) * pitch);
+                __m128i va = _mm_unpacklo_epi64(_mm_loadl_epi64(a0), _mm_loadl_epi64(a1));
+                __m128i vb = _mm_unpacklo_epi64(_mm_loadl_epi64(b0), _mm_loadl_epi64(b1));
+                sum = _mm_add_epi64(sum, _mm_sad_epu8(va, vb));
+            }
+        } else {
+            static_assert(PatchSize % 16 == 0, "fixed-size SAD kernels above 8 pixels need a multiple of 16");
+#pragma GCC unroll 64
+            for (int l = 0; l < PatchSize; l++) {
+#pragma GCC unroll 4
+                for (int m = 0; m < PatchSize; m += 16) {
+                    __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + l * pitch + m));
+                    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + l * pitch + m));
+                    sum = _mm_add_epi64(sum, _mm_sad_epu8(va, vb));
+                }
+            }
+        }
+    }
+    sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+    return static_cast<uint32_t>(_mm_cvtsi128_si32(sum));
+#else
+    return sad_patch_scalar(reference, target, pitch, channel_stride, Channels, PatchSize, PatchSize);
+#endif
+}
+
+#endif //SAD_H
@@ -0,0 +1,98 @@
+//
+// Per-thread bump allocator for the short-lived scratch data of the tile loops.
+//
+
+#ifndef SCRATCH_ARENA_H
+#define SCRATCH_ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+class ScratchArena {
+    /* Scratch memory handed out by moving a pointer through blocks that are kept for the life of the thread, so that
+       code run for every tile does not go through malloc (and does not contend with the other threads for it). The
+       memory is only given back by Scope, which rewinds the arena to where it was when the scope was opened, so a
+       tile loop opens one Scope per tile and reuses the same bytes every time. Blocks are only allocated while the
+       arena grows to the largest amount any tile has needed, after which heap_allocations() stays constant. Only
+       trivially destructible types may be allocated, as nothing is ever destroyed. */
+public:
+    class Scope {
+    public:
+        explicit Scope(ScratchArena &arena) : arena(arena), block(arena.block), used(arena.used) {}
+
+        ~Scope() {
+            arena.block = block;
+            arena.used = used;
+        }
+
+        Scope(const Scope &) = delete;
+
+        Scope &operator=(const Scope &) = delete;
+
+    private:
+        ScratchArena &arena;
+        size_t block;
+        size_t used;
+    };
+
+    // the arena of the calling thread
+    static ScratchArena &local() {
+        static thread_local ScratchArena arena;
+        return arena;
+    }
+
+    template<typename T>
+    T *allocate(size_t n) {
+        static_assert(std::is_trivially_destructible<T>::value, "the arena never runs destructors");
+        size_t bytes = n * sizeof(T);
+        size_t offset = align(used, alignof(T));
+        // move on to the next block that fits, growing the arena when none does
+        while (block < blocks.size() and offset + bytes > blocks[block].size) {
+            block++;
+            offset = 0;
+        }
+        if (block == blocks.size()) {
+            size_t size = std::max(bytes, blocks.empty() ? initial_block_size : 2 * blocks.back().size);
+            blocks.push_back({std::make_unique<std::byte[]>(size), size});
+            heap_blocks++;
+            offset = 0;
+        }
+        used = offset + bytes;
+        T *values = reinterpret_cast<T *>(blocks[block].data.get() + offset);
+        for (size_t k = 0; k < n; k++) {
+            new(values + k) T();
+        }
+        return values;
+    }
+
+    // number of blocks taken from the heap since the thread started
+    size_t heap_allocations() const {
+        return heap_blocks;
+    }
+
+private:
+    static constexpr size_t initial_block_size = 16 << 10;
+
+    struct Block {
+        std::unique_ptr<std::byte[]> data;
+        size_t size;
+    };
+
+    ScratchArena() : block(0), used(0), heap_blocks(0) {}
+
+    static size_t align(size_t offset, size_t alignment) {
+        return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    std::vector<Block> blocks;
+    // block being filled, and bytes of it already handed out
+    size_t block;
+    size_t used;
+    size_t heap_blocks;
+};
+
+#endif //SCRATCH_ARENA_H
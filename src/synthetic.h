@@ -0,0 +1,108 @@
+//
+// Synthetic light fields, so that the benchmarks and the golden check do not depend on a dataset on disk.
+//
+
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+#include "lightfield.h"
+
+struct SyntheticConfig {
+    int grid_rows = 5;
+    int grid_cols = 5;
+    int height = 256;
+    int width = 320;
+    // shift of the scene in pixels from one view to the next: along the rows between the views of a column, along
+    // the columns between the views of a row. Fractional disparities are interpolated
+    double row_disparity = 1;
+    double col_disparity = 1;
+    // standard deviation of the noise added to every pixel of every view, in grey levels
+    double noise = 0;
+    unsigned int seed = 0;
+};
+
+inline LightField synthetic_scene(const SyntheticConfig &config) {
+    /* Random texture seen from every view of the grid, view (i, j) showing it shifted by i * row_disparity rows and
+       j * col_disparity columns, so that a tile of view (i, j) is found in view (h, j) at row_disparity * (i - h)
+       rows from where it is, and in view (i, h) at col_disparity * (j - h) columns. The randomness is the raw
+       output of mt19937, the same everywhere, but the interpolation and the noise are computed in double precision.
+       With disparities and a noise level that are small multiples of powers of two (1, 0.5, -2...) every one of
+       those operations is exact, so that a seed gives the same views with any compiler, standard library and
+       floating-point flags (contracted multiply-adds included); the golden check only uses such scenes. Other
+       values round, and their views are only reproducible with the same compiler and flags */
+    std::mt19937 generator(config.seed);
+    auto extent = [](double disparity, int views) {
+        return (int) std::ceil(std::abs(disparity) * (views - 1)) + 1;
+    };
+    int texture_height = config.height + extent(config.row_disparity, config.grid_rows);
+    int texture_width = config.width + extent(config.col_disparity, config.grid_cols);
+    std::vector<uint8_t> texture((size_t) texture_height * texture_width * 3);
+    for (auto &value: texture) {
+        value = (uint8_t) (generator() >> 24);
+    }
+    auto texel = [&](int r, int c, int channel) {
+        return (double) texture[((size_t) r * texture_width + c) * 3 + channel];
+    };
+    // position in the texture of the first pixel of a view, kept non-negative for negative disparities
+    auto origin = [](double disparity, int views, int view) {
+        return disparity * view - std::min(0.0, disparity * (views - 1));
+    };
+
+    std::mt19937 noise_generator(config.seed + 1);
+    auto noise = [&]() {
+        // sum of 12 uniform draws, whose distribution is close to a normal one
+        double sum = -6;
+        for (int k = 0; k < 12; k++) {
+            sum += noise_generator() / 4294967296.0;
+        }
+        return sum * config.noise;
+    };
+
+    LightField scene = LightField(config.grid_rows, config.grid_cols, 3, config.height, config.width);
+    for (int i = 0; i < config.grid_rows; i++) {
+        double row_origin = origin(config.row_disparity, config.grid_rows, i);
+        int top = (int) std::floor(row_origin);
+        double down = row_origin - top;
+        for (int j = 0; j < config.grid_cols; j++) {
+            double col_origin = origin(config.col_disparity, config.grid_cols, j);
+            int left = (int) std::floor(col_origin);
+            double right = col_origin - left;
+            for (int c = 0; c < 3; c++) {
+                for (int r = 0; r < config.height; r++) {
+                    uint8_t *destination = scene.row(i, j, c, r);
+                    for (int col = 0; col < config.width; col++) {
+                        // bilinear interpolation, exact for integer disparities
+                        double value = (1 - down) * ((1 - right) * texel(top + r, left + col, c) +
+                                                     right * texel(top + r, left + col + 1, c)) +
+                                       down * ((1 - right) * texel(top + r + 1, left + col, c) +
+                                               right * texel(top + r + 1, left + col + 1, c));
+                        if (config.noise > 0) {
+                            value += noise();
+                        }
+                        destination[col] = (uint8_t) std::clamp(std::lround(value), 0L, 255L);
+                    }
+                }
+            }
+        }
+    }
+    return scene;
+}
+
+inline LightField synthetic_scene(int grid_size, int height, int width, unsigned int seed) {
+    // grid_size x grid_size views shifted by one pixel per grid step, so that every patch has a true match in the
+    // neighbouring views
+    SyntheticConfig config;
+    config.grid_rows = grid_size;
+    config.grid_cols = grid_size;
+    config.height = height;
+    config.width = width;
+    config.seed = seed;
+    return synthetic_scene(config);
+}
+
+#endif //SYNTHETIC_H
@@ -0,0 +1,120 @@
+//
+// Fixed-capacity list of the best matches of a tile, kept without any heap allocation, and the matches of a whole view.
+//
+
+#ifndef TOP_MATCHES_H
+#define TOP_MATCHES_H
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// most matches a single tile can keep
+constexpr int max_similar = 64;
+
+struct Match {
+    int view_row;
+    int view_col;
+    int row;
+    int col;
+    uint8_t difference;
+};
+
+class TopMatches {
+    /* The k matches with the smallest difference among those inserted, stored inline so that it can live on the
+       stack of the search. Until k matches have been inserted they are kept in insertion order, and once the k-th
+       one arrives the list is sorted by difference (an exchange sort, which may reorder equal differences). After
+       that a new match is dropped unless it is strictly better than the worst one, so a tie with the worst keeps the
+       match found first, and otherwise goes before every match that is not better than it, so among the matches
+       kept with the same difference the one found last comes first. The outputs depend on this order, which
+       PatchMatchGolden checks. */
+public:
+    explicit TopMatches(int k) : k(k), count(0) {
+        if (k > max_similar) {
+            throw std::invalid_argument("at most " + std::to_string(max_similar) + " similar patches per tile, got " +
+                                        std::to_string(k));
+        }
+    }
+
+    void insert(const Match &match) {
+        if (count < k) {
+            matches[count++] = match;
+            if (count == k) {
+                for (int a = 0; a < count; a++) {
+                    for (int b = a + 1; b < count; b++) {
+                        if (matches[a].difference > matches[b].difference) {
+                            std::swap(matches[a], matches[b]);
+                        }
+                    }
+                }
+            }
+            return;
+        }
+        if (k == 0 or match.difference >= matches[k - 1].difference) {
+            return;
+        }
+        // shift the worse matches one place down, dropping the last one
+        int position = k - 1;
+        while (position > 0 and matches[position - 1].difference >= match.difference) {
+            matches[position] = matches[position - 1];
+            position--;
+        }
+        matches[position] = match;
+    }
+
+    int size() const {
+        return count;
+    }
+
+    const Match &operator[](int n) const {
+        return matches[n];
+    }
+
+    // the matches as {view_row, view_col, row, col}, the form the rest of the pipeline takes
+    std::vector<std::vector<int>> to_vectors() const {
+        std::vector<std::vector<int>> result(count);
+        for (int n = 0; n < count; n++) {
+            result[n] = {matches[n].view_row, matches[n].view_col, matches[n].row, matches[n].col};
+        }
+        return result;
+    }
+
+private:
+    int k;
+    int count;
+    Match matches[max_similar];
+};
+
+struct ViewMatches {
+    /* The matches of every tile of a view, in row-major tile order: at most `capacity` per tile, in a single
+       allocation so that the tile loops can store their TopMatches without allocating. */
+    ViewMatches() : capacity(0) {}
+
+    ViewMatches(size_t tiles, int capacity) : capacity(capacity), counts(tiles, 0), matches(tiles * capacity) {}
+
+    size_t tiles() const {
+        return counts.size();
+    }
+
+    int size(size_t tile) const {
+        return counts[tile];
+    }
+
+    const Match &at(size_t tile, int n) const {
+        return matches[tile * capacity + n];
+    }
+
+    void assign(size_t tile, const TopMatches &top) {
+        counts[tile] = top.size();
+        for (int n = 0; n < top.size(); n++) {
+            matches[tile * capacity + n] = top[n];
+        }
+    }
+
+    int capacity;
+    std::vector<int> counts;
+    std::vector<Match> matches;
+};
+
+#endif //TOP_MATCHES_H
@@ -2,13 +2,55 @@
 // Created by tsfeith on 13/12/22.
 //
 
+#include <climits>
+#include <exception>
 #include <filesystem>
+#include <mutex>
+#include <numeric>
+#include <random>
 #include <vector>
 #include <opencv2/opencv.hpp>
+#include "async_writer.h"
 #include "cnpy.h"
+#include "cost_volume.h"
+#include "integral_costs.h"
+#include "lightfield.h"
+#include "patchmatch.h"
+#include "profiler.h"
+#include "sad.h"
+#include "scratch_arena.h"
+#include "top_matches.h"
+#include "view_cache.h"
 
 using namespace std;
 
+class TaskErrors {
+    /* The first exception thrown by the work of a group of OpenMP tasks, which must not let it escape (that ends the
+       program), kept for the thread waiting for the group to rethrow once every task is done. */
+public:
+    template<typename Work>
+    void run(Work work) {
+        try {
+            work();
+        } catch (...) {
+            lock_guard<mutex> lock(errors_mutex);
+            if (!error) {
+                error = current_exception();
+            }
+        }
+    }
+
+    void rethrow() const {
+        if (error) {
+            rethrow_exception(error);
+        }
+    }
+
+private:
+    mutex errors_mutex;
+    exception_ptr error;
+};
+
 vector<string> get_scene_names(const string &scene_dir, int grid_size_0, int grid_size_1) {
     vector<string> scene_names;
     for (const auto &entry: filesystem::directory_iterator(scene_dir)) {
@@ -30,309 +72,1151 @@ vector<string> get_scene_names(const string &scene_dir, int grid_size_0, int gri
     return scene_names;
 }
 
-vector<vector<vector<vector<vector<uint8_t>>>>> get_scene_grid(const string &directory_path,
-                                                               int grid_size_0,
-                                                               int grid_size_1) {
-    vector<vector<vector<vector<vector<uint8_t>>>>> scene_grid;
+template<typename Field>
+void downsample_view(const Field &field, LightField &half, int i, int j) {
+    // halve the resolution of view (i, j) of `field` (a LightField or a LightFieldView) into `half`, averaging (with
+    // rounding) the pixels of each 2x2 block. Odd sizes are rounded up, and the blocks on the last row / column
+    // average the pixels they do have
+    for (int c = 0; c < field.channels; c++) {
+        for (int r = 0; r < half.height; r++) {
+            const uint8_t *top = field.row(i, j, c, 2 * r);
+            const uint8_t *bottom = field.row(i, j, c, min(2 * r + 1, field.height - 1));
+            uint8_t *destination = half.row(i, j, c, r);
+            for (int m = 0; m < half.width; m++) {
+                int right = min(2 * m + 1, field.width - 1);
+                destination[m] = (uint8_t) ((top[2 * m] + top[right] + bottom[2 * m] + bottom[right] + 2) / 4);
+            }
+        }
+    }
+}
+
+LightField downsample(const LightField &field) {
+    LightField half = LightField(field.grid_rows, field.grid_cols, field.channels,
+                                 (field.height + 1) / 2, (field.width + 1) / 2);
+    for (int i = 0; i < field.grid_rows; i++) {
+        for (int j = 0; j < field.grid_cols; j++) {
+            downsample_view(field, half, i, j);
+        }
+    }
+    return half;
+}
+
+vector<filesystem::directory_entry> get_scene_files(const string &directory_path, int grid_size_0, int grid_size_1) {
     vector<filesystem::directory_entry> entries;
-    // start by getting all the png files in the directory
+    // get all the png files in the directory that fall inside the selected subgrid
     for (const auto &entry: filesystem::directory_iterator(directory_path)) {
         if (entry.path().extension() != ".png") {
             continue;
         }
+        string filename = entry.path().filename().string();
+        if (stoi(filename.substr(filename.size() - 9, 2)) >= grid_size_0 or
+            stoi(filename.substr(filename.size() - 6, 2)) >= grid_size_1) {
+            continue;
+        }
         entries.push_back(entry);
     }
     sort(entries.begin(), entries.end(),
          [](const filesystem::directory_entry &a, const filesystem::directory_entry &b) {
              return a.path().filename() < b.path().filename();
          });
+    return entries;
+}
 
-    // take the sorted filenames, and get them into a grid of size grid_size_0 x grid_size_1
-    for (const auto &entry: entries) {
-        string filename = entry.path().filename().string();
-        int row = stoi(filename.substr(filename.length() - 9, 2));
-        if (row == scene_grid.size()) {
-            if (scene_grid.size() == grid_size_0) {
-                break;
-            }
-            scene_grid.emplace_back();
+vector<int> view_position(const filesystem::directory_entry &entry) {
+    // row and column of a view, from the last two numbers of its filename
+    string filename = entry.path().filename().string();
+    return {stoi(filename.substr(filename.size() - 9, 2)), stoi(filename.substr(filename.size() - 6, 2))};
+}
+
+LightField allocate_scene_grid(int grid_size_0, int grid_size_1, int height, int width, int pyramid_levels = 0) {
+    // storage for the whole scene and for its coarser copies (for the pyramid matching mode), before any view is
+    // decoded, so that the views can be filled in any order
+    LightField scene_grid = LightField(grid_size_0, grid_size_1, 3, height, width);
+    for (int level = 0; level < pyramid_levels; level++) {
+        height = (height + 1) / 2;
+        width = (width + 1) / 2;
+        scene_grid.pyramid.emplace_back(grid_size_0, grid_size_1, 3, height, width);
+    }
+    return scene_grid;
+}
+
+cv::Mat decode_view(const string &path) {
+    ProfileScope scope(Phase::decode);
+    profile_count(Counter::views_decoded, 1);
+    cv::Mat image = cv::imread(path);
+    if (image.empty()) {
+        throw runtime_error("cannot decode the view " + path);
+    }
+    return image;
+}
+
+void store_view(LightField &scene_grid, int row, int col, const cv::Mat &image) {
+    if (image.rows != scene_grid.height or image.cols != scene_grid.width) {
+        throw runtime_error("view (" + to_string(row) + ", " + to_string(col) + ") is " + to_string(image.cols) + "x" +
+                            to_string(image.rows) + ", the first view of the scene " + to_string(scene_grid.width) +
+                            "x" + to_string(scene_grid.height));
+    }
+    // openCV uses the colour space BGR, so the planes it splits the image into are handed out in reverse order. The
+    // planes wrap the rows of the grid (with their padded pitch), so the vectorized split writes straight into them
+    {
+        ProfileScope scope(Phase::colour_conversion, row, col);
+        cv::Mat planes[3];
+        for (int c = 0; c < 3; c++) {
+            planes[2 - c] = cv::Mat(image.rows, image.cols, CV_8UC1, scene_grid.row(row, col, c, 0),
+                                    scene_grid.pitch);
         }
-        if (scene_grid[row].size() == grid_size_1) {
-            continue;
+        cv::split(image, planes);
+    }
+
+    // coarser copies of the view, each one from the previous
+    for (size_t level = 0; level < scene_grid.pyramid.size(); level++) {
+        downsample_view(level == 0 ? scene_grid : scene_grid.pyramid[level - 1], scene_grid.pyramid[level], row, col);
+    }
+}
+
+template<typename OnResident>
+void load_views(LightField &scene_grid,
+                const vector<filesystem::directory_entry> &files,
+                const cv::Mat &first,
+                OnResident on_resident) {
+    /* Decode the views listed in `files` into scene_grid, one OpenMP task per view, and call on_resident(i, j) as
+       soon as view (i, j) and all the other views of its row and column are resident, which is everything the
+       search of view (i, j) reads. `first` is the already decoded image of files[0] (the one that gave the size of
+       the grid). Meant to be called by a single thread of a parallel region, so that on_resident can itself spawn
+       tasks; returns once every view is loaded and every task spawned from on_resident is done. A view that cannot
+       be loaded is only reported then, by rethrowing its error, the views that do not need it being matched
+       anyway. */
+    vector<vector<int>> positions;
+    for (const auto &entry: files) {
+        positions.push_back(view_position(entry));
+    }
+    // number of views of its row and column each view is still waiting for
+    vector<int> missing(scene_grid.grid_rows * scene_grid.grid_cols, 0);
+    for (const auto &position: positions) {
+        for (int i = 0; i < scene_grid.grid_rows; i++) {
+            for (int j = 0; j < scene_grid.grid_cols; j++) {
+                if (i == position[0] or j == position[1]) {
+                    missing[i * scene_grid.grid_cols + j]++;
+                }
+            }
         }
-        // use openCV to read the image
-        cv::Mat image = cv::imread(entry.path().string());
-
-        // openCV uses the colour space BGR, so we need to convert it to RGB
-        vector<vector<vector<uint8_t>>> data = vector<vector<vector<uint8_t>>>(3, vector<vector<uint8_t>>(image.rows,
-                                                                                                          vector<uint8_t>(
-                                                                                                                  image.cols)));
-        for (int i = 0; i < image.rows; i++) {
-            for (int j = 0; j < image.cols; j++) {
-                cv::Vec3b pixel = image.at<cv::Vec3b>(i, j);
-                data[0][i][j] = pixel[2];
-                data[1][i][j] = pixel[1];
-                data[2][i][j] = pixel[0];
+    }
+
+    TaskErrors errors;
+    #pragma omp taskgroup
+    {
+        for (size_t v = 0; v < missing.size(); v++) {
+            if (missing[v] == 0) {
+                on_resident((int) v / scene_grid.grid_cols, (int) v % scene_grid.grid_cols);
             }
         }
-        scene_grid[row].push_back(data);
+        for (size_t f = 0; f < files.size(); f++) {
+            #pragma omp task default(none) firstprivate(f) \
+                    shared(scene_grid, files, first, positions, missing, on_resident, errors)
+            errors.run([&] {
+                int row = positions[f][0];
+                int col = positions[f][1];
+                {
+                    ProfileScope scope(Phase::load, row, col);
+                    store_view(scene_grid, row, col, f == 0 ? first : decode_view(files[f].path().string()));
+                }
+                for (int i = 0; i < scene_grid.grid_rows; i++) {
+                    for (int j = 0; j < scene_grid.grid_cols; j++) {
+                        if (i != row and j != col) {
+                            continue;
+                        }
+                        int left;
+                        // seq_cst, so that whoever sees the count reach zero also sees the pixels of every view
+                        #pragma omp atomic capture seq_cst
+                        left = --missing[i * scene_grid.grid_cols + j];
+                        if (left == 0) {
+                            on_resident(i, j);
+                        }
+                    }
+                }
+            });
+        }
     }
+    errors.rethrow();
+}
+
+LightField get_scene_grid(const string &directory_path, int grid_size_0, int grid_size_1, int pyramid_levels = 0) {
+    vector<filesystem::directory_entry> files = get_scene_files(directory_path, grid_size_0, grid_size_1);
+    // all the views share the same resolution, so the first one decides the size of the whole grid
+    cv::Mat first = decode_view(files[0].path().string());
+    LightField scene_grid = allocate_scene_grid(grid_size_0, grid_size_1, first.rows, first.cols, pyramid_levels);
+    #pragma omp parallel default(none) shared(scene_grid, files, first)
+    #pragma omp single
+    load_views(scene_grid, files, first, [](int, int) {});
     return scene_grid;
 }
 
-void limited_insert(vector<vector<int>> &matching_patches,
-                    vector<uint8_t> &differences,
-                    const vector<int> &best_patch,
-                    uint8_t min_diff,
-                    int max_size) {
-    // if the differences vector is not full yet, just add the new patch
-    if (differences.size() < max_size) {
-        matching_patches.emplace_back(best_patch);
-        differences.emplace_back(min_diff);
-        // check to see if it is now full
-        // if it is, sort the differences vector and the matching patches vector jointly
-        // we're using a bubble sort here, but it should be fine since the vector is small (~<10)
-        if (differences.size() == max_size) {
-            for (int i = 0; i < differences.size(); i++) {
-                for (int j = i + 1; j < differences.size(); j++) {
-                    if (differences[i] > differences[j]) {
-                        swap(differences[i], differences[j]);
-                        swap(matching_patches[i], matching_patches[j]);
-                    }
+template<typename Process>
+size_t stream_views(const vector<filesystem::directory_entry> &files,
+                    int grid_size_0,
+                    int grid_size_1,
+                    int height,
+                    int width,
+                    int pyramid_levels,
+                    size_t max_bytes,
+                    Process process) {
+    /* Bounded-memory alternative to get_scene_grid + load_views: the reference views are visited one at a time in
+       serpentine order, and before each one the views of its row and column are decoded into a ViewCache of at
+       most max_bytes, evicting the views needed again the latest. process(grid, i, j) then gets a LightFieldView in
+       which the row and column of view (i, j) are resident. The views are decoded in parallel, but the reference
+       views are processed one after the other, so process should spread its own work over OpenMP tasks (as the
+       tile loops of match_view do). Like load_views, meant to be called by a single thread of a parallel region.
+       Returns the number of views decoded, which is the grid size when everything fits in max_bytes. */
+    vector<string> paths(grid_size_0 * grid_size_1);
+    for (const auto &entry: files) {
+        vector<int> position = view_position(entry);
+        paths[position[0] * grid_size_1 + position[1]] = entry.path().string();
+    }
+    ViewCache cache = ViewCache(grid_size_0, grid_size_1, height, width, pyramid_levels,
+                                ViewCache::serpentine_schedule(grid_size_0, grid_size_1), max_bytes);
+    // the views are loaded by the tasks of the cache, so their errors are rethrown once each step is resident
+    TaskErrors errors;
+    auto load = [&](LightField &slot, int view_row, int view_col) {
+        errors.run([&] {
+            const string &path = paths[view_row * grid_size_1 + view_col];
+            ProfileScope scope(Phase::load, view_row, view_col);
+            if (path.empty()) {
+                // same as the views missing from a fully loaded scene
+                fill(slot.data.begin(), slot.data.end(), 0);
+                for (auto &level: slot.pyramid) {
+                    fill(level.data.begin(), level.data.end(), 0);
                 }
+                return;
             }
-        }
+            store_view(slot, 0, 0, decode_view(path));
+        });
+    };
+    for (size_t step = 0; step < cache.steps(); step++) {
+        cache.advance(step, load);
+        errors.rethrow();
+        process(cache.grid(), cache.reference(step)[0], cache.reference(step)[1]);
+    }
+    return cache.decoded();
+}
+
+template<int PatchSize, int Channels, MatchMode Mode>
+int patch_difference(const LightFieldView &grid,
+                     int i,
+                     int j,
+                     int start_row,
+                     int start_col,
+                     int view_row,
+                     int view_col,
+                     int row,
+                     int col,
+                     const int *patchsize,
+                     int bound) {
+    // get the L1 difference between the reference patch of view (i, j) and the patch of view (view_row, view_col)
+    // with top-left corner in (row, col), summed over all the channels. All the views share the same pitch and
+    // channel stride, so the SIMD kernel can walk both patches with the same offsets
+    const uint8_t *reference = grid.row(i, j, 0, start_row) + start_col;
+    const uint8_t *target = grid.row(view_row, view_col, 0, row) + col;
+    if constexpr (Mode == MatchMode::incremental) {
+        // the candidate only matters if its difference stays below `bound`, so stop accumulating once it gets there
+        return (int) sad_patch_bounded(reference, target, grid.pitch, grid.channel_stride, grid.channels,
+                                       patchsize[0], patchsize[1], bound);
+    } else if constexpr (PatchSize == 0) {
+        return (int) sad_patch(reference, target, grid.pitch, grid.channel_stride, grid.channels,
+                               patchsize[0], patchsize[1]);
     } else {
-        // if the differences vector is full, check to see if the new patch is better than the worst one
-        if (min_diff >= differences[max_size - 1]) {
-            return;
-        }
-        // if it is, put it in the right place in the vector using binary search (since the vector is sorted)
-        differences.pop_back();
-        matching_patches.pop_back();
-        int left = 0;
-        int right = max_size - 2;
-        while (left < right) {
-            int mid = (left + right) / 2;
-            if (differences[mid] < min_diff) {
-                left = mid + 1;
-            } else {
-                right = mid;
-            }
-        }
-        differences.insert(differences.begin() + left, min_diff);
-        matching_patches.insert(matching_patches.begin() + left, best_patch);
+        return (int) sad_patch_fixed<PatchSize, Channels>(reference, target, grid.pitch, grid.channel_stride);
     }
 }
 
-vector<vector<int>> get_matching_patches(vector<vector<vector<vector<vector<uint8_t>>>>> grid,
-                                         int i,
-                                         int j,
-                                         int start_row,
-                                         int start_col,
-                                         int patch_size,
-                                         int num_similar,
-                                         int search_stride,
-                                         int roi) {
-    vector<int> patchsize = vector<int>(2, 0);
-    patchsize[0] = min((int) grid[i][j][0].size() - start_row, patch_size);
-    patchsize[1] = min((int) grid[i][j][0][0].size() - start_col, patch_size);
+template<int PatchSize, int Channels, MatchMode Mode>
+void get_matching_patches(const LightFieldView &grid,
+                          int i,
+                          int j,
+                          int start_row,
+                          int start_col,
+                          int patch_size,
+                          int search_stride,
+                          int roi,
+                          TopMatches &matching_patches) {
+    // the best matches of the tile go into matching_patches. Nothing here touches the heap, the whole state of the
+    // search is a handful of ints
+    int patchsize[2] = {min(grid.height - start_row, patch_size), min(grid.width - start_col, patch_size)};
+    if constexpr (PatchSize != 0) {
+        // patches on the image border are clipped, and those go through the runtime-size kernel
+        if (patchsize[0] != PatchSize or patchsize[1] != PatchSize) {
+            get_matching_patches<0, 0, Mode>(grid, i, j, start_row, start_col, patch_size, search_stride, roi,
+                                             matching_patches);
+            return;
+        }
+    }
+    const int num_values = PatchSize ? Channels * PatchSize * PatchSize : grid.channels * patchsize[0] * patchsize[1];
 
-    vector<vector<int>> matching_patches;
-    vector<uint8_t> differences;
-    vector<int> prev_position = {start_row, start_col};
+    int prev_position[2] = {start_row, start_col};
+    int candidates = 0;
 
     // search to the views on the right
-    for (int h = j + 1; h < grid[i].size(); h++) {
+    for (int h = j + 1; h < grid.grid_cols; h++) {
         uint8_t min_difference = 255;
         for (int a = -roi; a <= roi; a++) {
             if (prev_position[1] + a * search_stride < 0 or
-                prev_position[1] + a * search_stride + patchsize[1] > grid[i][h][0][0].size()) {
+                prev_position[1] + a * search_stride + patchsize[1] > grid.width) {
                 continue;
             }
             int pos = prev_position[1] + a * search_stride;
-            int difference = 0;
-            // get the L1 difference between the reference patch and the current patch
-            // using new variables would make it easier to read, but it's faster to just access the grid
-            for (int l = 0; l < patchsize[0]; l++) {
-                for (int m = 0; m < patchsize[1]; m++) {
-                    difference += abs(grid[i][h][0][prev_position[0] + l][pos + m] -
-                                      grid[i][j][0][start_row + l][start_col + m]);
-                    difference += abs(grid[i][h][1][prev_position[0] + l][pos + m] -
-                                      grid[i][j][1][start_row + l][start_col + m]);
-                    difference += abs(grid[i][h][2][prev_position[0] + l][pos + m] -
-                                      grid[i][j][2][start_row + l][start_col + m]);
-                }
-            }
-            difference /= 3 * patchsize[0] * patchsize[1];
+            int difference = patch_difference<PatchSize, Channels, Mode>(grid, i, j, start_row, start_col,
+                                                                         i, h, prev_position[0], pos, patchsize,
+                                                                         min_difference * num_values);
+            difference /= num_values;
+            candidates++;
 
             if (difference < min_difference) {
                 min_difference = (uint8_t) difference;
-                prev_position = {prev_position[0], pos};
+                prev_position[1] = pos;
             }
         }
-        limited_insert(matching_patches, differences, {i, h, prev_position[0], prev_position[1]}, min_difference,
-                       num_similar);
+        matching_patches.insert({i, h, prev_position[0], prev_position[1], (uint8_t) min_difference});
     }
 
     // search to the views on the left
-    prev_position = {start_row, start_col};
+    prev_position[0] = start_row;
+    prev_position[1] = start_col;
     for (int h = j - 1; h >= 0; h--) {
         int min_difference = 255;
         for (int a = -roi; a <= roi; a++) {
             if (prev_position[1] + a * search_stride < 0 or
-                prev_position[1] + a * search_stride + patchsize[1] > grid[i][h][0][0].size()) {
+                prev_position[1] + a * search_stride + patchsize[1] > grid.width) {
                 continue;
             }
             int pos = prev_position[1] + a * search_stride;
-            int difference = 0;
-            for (int l = 0; l < patchsize[0]; l++) {
-                for (int m = 0; m < patchsize[1]; m++) {
-                    difference += abs(
-                            grid[i][h][0][prev_position[0] + l][pos + m] - grid[i][j][0][start_row + l][start_col + m]);
-                    difference += abs(
-                            grid[i][h][1][prev_position[0] + l][pos + m] - grid[i][j][1][start_row + l][start_col + m]);
-                    difference += abs(
-                            grid[i][h][2][prev_position[0] + l][pos + m] - grid[i][j][2][start_row + l][start_col + m]);
-                }
-            }
-            difference /= 3 * patchsize[0] * patchsize[1];
+            int difference = patch_difference<PatchSize, Channels, Mode>(grid, i, j, start_row, start_col,
+                                                                         i, h, prev_position[0], pos, patchsize,
+                                                                         min_difference * num_values);
+            difference /= num_values;
+            candidates++;
             if (difference < min_difference) {
                 min_difference = (uint8_t) difference;
-                prev_position = {prev_position[0], pos};
+                prev_position[1] = pos;
             }
         }
-        limited_insert(matching_patches, differences, {i, h, prev_position[0], prev_position[1]}, min_difference,
-                       num_similar);
+        matching_patches.insert({i, h, prev_position[0], prev_position[1], (uint8_t) min_difference});
     }
 
     // search to the views on the bottom
-    prev_position = {start_row, start_col};
-    for (int h = i + 1; h < grid.size(); h++) {
+    prev_position[0] = start_row;
+    prev_position[1] = start_col;
+    for (int h = i + 1; h < grid.grid_rows; h++) {
         int min_difference = 255;
         for (int a = -roi; a <= roi; a++) {
             if (prev_position[0] + a * search_stride < 0 or
-                prev_position[0] + a * search_stride + patchsize[0] > grid[h][j][0].size()) {
+                prev_position[0] + a * search_stride + patchsize[0] > grid.height) {
                 continue;
             }
             int pos = prev_position[0] + a * search_stride;
-            int difference = 0;
-            for (int l = 0; l < patchsize[0]; l++) {
-                for (int m = 0; m < patchsize[1]; m++) {
-                    difference += abs(
-                            grid[i][h][0][prev_position[0] + l][pos + m] - grid[i][j][0][start_row + l][start_col + m]);
-                    difference += abs(
-                            grid[i][h][1][prev_position[0] + l][pos + m] - grid[i][j][1][start_row + l][start_col + m]);
-                    difference += abs(
-                            grid[i][h][2][prev_position[0] + l][pos + m] - grid[i][j][2][start_row + l][start_col + m]);
-                }
-            }
-            difference /= 3 * patchsize[0] * patchsize[1];
+            int difference = patch_difference<PatchSize, Channels, Mode>(grid, i, j, start_row, start_col,
+                                                                         h, j, pos, prev_position[1], patchsize,
+                                                                         min_difference * num_values);
+            difference /= num_values;
+            candidates++;
             if (difference < min_difference) {
                 min_difference = (uint8_t) difference;
-                prev_position = {pos, prev_position[1]};
+                prev_position[0] = pos;
             }
         }
-        limited_insert(matching_patches, differences, {h, j, prev_position[0], prev_position[1]}, min_difference,
-                       num_similar);
+        matching_patches.insert({h, j, prev_position[0], prev_position[1], (uint8_t) min_difference});
     }
 
     // search to the views on the top
-    prev_position = {start_row, start_col};
-    for (int h = j - 1; h >= 0; h--) {
+    prev_position[0] = start_row;
+    prev_position[1] = start_col;
+    for (int h = i - 1; h >= 0; h--) {
         int min_difference = 255;
         for (int a = -roi; a <= roi; a++) {
             if (prev_position[0] + a * search_stride < 0 or
-                prev_position[0] + a * search_stride + patchsize[0] > grid[h][j][0].size()) {
+                prev_position[0] + a * search_stride + patchsize[0] > grid.height) {
                 continue;
             }
             int pos = prev_position[0] + a * search_stride;
-            int difference = 0;
-            for (int l = 0; l < patchsize[0]; l++) {
-                for (int m = 0; m < patchsize[1]; m++) {
-                    difference += abs(
-                            grid[i][h][0][prev_position[0] + l][pos + m] - grid[i][j][0][start_row + l][start_col + m]);
-                    difference += abs(
-                            grid[i][h][1][prev_position[0] + l][pos + m] - grid[i][j][1][start_row + l][start_col + m]);
-                    difference += abs(
-                            grid[i][h][2][prev_position[0] + l][pos + m] - grid[i][j][2][start_row + l][start_col + m]);
-                }
-            }
+            int difference = patch_difference<PatchSize, Channels, Mode>(grid, i, j, start_row, start_col,
+                                                                         h, j, pos, prev_position[1], patchsize,
+                                                                         min_difference * num_values);
+            difference /= num_values;
+            candidates++;
             if (difference < min_difference) {
                 min_difference = (uint8_t) difference;
-                prev_position = {pos, prev_position[1]};
+                prev_position[0] = pos;
             }
         }
-        limited_insert(matching_patches, differences, {h, j, prev_position[0], prev_position[1]}, min_difference,
-                       num_similar);
+        matching_patches.insert({h, j, prev_position[0], prev_position[1], (uint8_t) min_difference});
+    }
+    profile_count(Counter::candidates, candidates);
+    profile_count(Counter::top_k_inserts, grid.grid_rows + grid.grid_cols - 2);
+}
+
+vector<vector<vector<int>>> search_directions(const LightFieldView &grid, int i, int j) {
+    // the target views of each direction (right, left, bottom, top), in the order get_matching_patches visits them
+    vector<vector<vector<int>>> directions(4);
+    for (int h = j + 1; h < grid.grid_cols; h++) {
+        directions[0].push_back({i, h});
+    }
+    for (int h = j - 1; h >= 0; h--) {
+        directions[1].push_back({i, h});
+    }
+    for (int h = i + 1; h < grid.grid_rows; h++) {
+        directions[2].push_back({h, j});
+    }
+    for (int h = i - 1; h >= 0; h--) {
+        directions[3].push_back({h, j});
+    }
+    return directions;
+}
+
+// how far around the upsampled match of the coarser level every finer level of the pyramid searches
+constexpr int pyramid_refine_roi = 2;
+
+int scan_positions(const LightFieldView &grid,
+                   int i,
+                   int j,
+                   int start_row,
+                   int start_col,
+                   const int *patchsize,
+                   int view_row,
+                   int view_col,
+                   int *position,
+                   int search_stride,
+                   int roi) {
+    // the chained scan of get_matching_patches for a single target view, along the rows for views in column j and
+    // along the columns otherwise. position is moved to the best candidate, whose difference is returned
+    int axis = view_col == j ? 0 : 1;
+    int extent = axis == 0 ? grid.height : grid.width;
+    int min_difference = 255;
+    int candidate[2] = {position[0], position[1]};
+    int candidates = 0;
+    for (int a = -roi; a <= roi; a++) {
+        candidate[axis] = position[axis] + a * search_stride;
+        if (candidate[axis] < 0 or candidate[axis] + patchsize[axis] > extent) {
+            continue;
+        }
+        candidates++;
+        int difference = patch_difference<0, 0, MatchMode::exhaustive>(grid, i, j, start_row, start_col,
+                                                                        view_row, view_col, candidate[0],
+                                                                        candidate[1], patchsize, 0);
+        difference /= grid.channels * patchsize[0] * patchsize[1];
+        if (difference < min_difference) {
+            min_difference = difference;
+            position[axis] = candidate[axis];
+        }
+    }
+    profile_count(Counter::candidates, candidates);
+    return min_difference;
+}
+
+void get_matching_patches_pyramid(const LightFieldView &grid,
+                                  int i,
+                                  int j,
+                                  int start_row,
+                                  int start_col,
+                                  int patch_size,
+                                  int search_stride,
+                                  int roi,
+                                  TopMatches &matching_patches) {
+    /* Coarse-to-fine version of get_matching_patches. The chained search runs on the coarsest level of the
+       pyramid, covering the same distance as roi * search_stride at full resolution. Every finer level then only
+       searches pyramid_refine_roi pixels around twice the position found on the level above. */
+    if (grid.pyramid.empty()) {
+        get_matching_patches<0, 0, MatchMode::exhaustive>(grid, i, j, start_row, start_col, patch_size, search_stride,
+                                                          roi, matching_patches);
+        return;
+    }
+    int levels = (int) grid.pyramid.size();
+    ScratchArena &arena = ScratchArena::local();
+    ScratchArena::Scope scope(arena);
+
+    // target views in search order (right, left, bottom, top, as search_directions), each with the best position
+    // found in it so far, and the index of the first view of every direction
+    int num_views = grid.grid_rows + grid.grid_cols - 2;
+    Match *views = arena.allocate<Match>(num_views);
+    int first_view[5] = {0};
+    const int steps[4][2] = {{0, 1}, {0, -1}, {1, 0}, {-1, 0}};
+    for (int d = 0; d < 4; d++) {
+        first_view[d + 1] = first_view[d];
+        int view_row = i + steps[d][0];
+        int view_col = j + steps[d][1];
+        for (; view_row >= 0 and view_row < grid.grid_rows and view_col >= 0 and view_col < grid.grid_cols;
+               view_row += steps[d][0], view_col += steps[d][1]) {
+            views[first_view[d + 1]++] = {view_row, view_col, 0, 0, 0};
+        }
+    }
+
+    for (int level = levels; level >= 0; level--) {
+        const LightFieldView &current = level == 0 ? grid : grid.pyramid[level - 1];
+        int row = start_row >> level;
+        int col = start_col >> level;
+        int patchsize[2] = {min(current.height - row, max(1, patch_size >> level)),
+                            min(current.width - col, max(1, patch_size >> level))};
+        if (level == levels) {
+            int coarse_roi = (roi * search_stride + (1 << levels) - 1) >> levels;
+            for (int d = 0; d < 4; d++) {
+                int position[2] = {row, col};
+                for (int k = first_view[d]; k < first_view[d + 1]; k++) {
+                    views[k].difference = (uint8_t) scan_positions(current, i, j, row, col, patchsize,
+                                                                   views[k].view_row, views[k].view_col, position, 1,
+                                                                   coarse_roi);
+                    views[k].row = position[0];
+                    views[k].col = position[1];
+                }
+            }
+            continue;
+        }
+        for (int k = 0; k < num_views; k++) {
+            int axis = views[k].view_col == j ? 0 : 1;
+            int extent = axis == 0 ? current.height : current.width;
+            int position[2] = {row, col};
+            position[axis] = min(2 * (axis == 0 ? views[k].row : views[k].col), extent - patchsize[axis]);
+            views[k].difference = (uint8_t) scan_positions(current, i, j, row, col, patchsize, views[k].view_row,
+                                                           views[k].view_col, position, 1, pyramid_refine_roi);
+            views[k].row = position[0];
+            views[k].col = position[1];
+        }
+    }
+
+    for (int k = 0; k < num_views; k++) {
+        matching_patches.insert(views[k]);
+    }
+    profile_count(Counter::top_k_inserts, num_views);
+}
+
+bool match_mode_available(MatchMode mode) {
+    return mode != MatchMode::cost_volume or PATCHMATCH_COST_VOLUME;
+}
+
+typedef void (*matcher_fn)(const LightFieldView &, int, int, int, int, int, int, int, TopMatches &);
+
+matcher_fn select_matcher(int patch_size, int channels, MatchMode mode) {
+    // the whole-view modes give the same matches as the exhaustive search, which is what a single tile gets
+    if (mode == MatchMode::cost_volume or mode == MatchMode::integral or mode == MatchMode::patchmatch) {
+        mode = MatchMode::exhaustive;
+    }
+    // the patch sizes we almost always run with get a matcher specialized at compile time
+    static const struct {
+        int patch_size;
+        int channels;
+        MatchMode mode;
+        matcher_fn matcher;
+    } matchers[] = {
+            {8,  3, MatchMode::exhaustive, get_matching_patches<8, 3, MatchMode::exhaustive>},
+            {16, 3, MatchMode::exhaustive, get_matching_patches<16, 3, MatchMode::exhaustive>},
+            {32, 3, MatchMode::exhaustive, get_matching_patches<32, 3, MatchMode::exhaustive>},
+    };
+    for (const auto &entry: matchers) {
+        if (entry.patch_size == patch_size and entry.channels == channels and entry.mode == mode) {
+            return entry.matcher;
+        }
+    }
+    if (mode == MatchMode::incremental) {
+        return get_matching_patches<0, 0, MatchMode::incremental>;
+    }
+    if (mode == MatchMode::pyramid) {
+        return get_matching_patches_pyramid;
+    }
+    return get_matching_patches<0, 0, MatchMode::exhaustive>;
+}
+
+vector<vector<int>> get_matching_patches(const LightFieldView &grid,
+                                         int i,
+                                         int j,
+                                         int start_row,
+                                         int start_col,
+                                         int patch_size,
+                                         int num_similar,
+                                         int search_stride,
+                                         int roi,
+                                         MatchMode mode = MatchMode::exhaustive) {
+    TopMatches matching_patches(num_similar);
+    select_matcher(patch_size, grid.channels, mode)(grid, i, j, start_row, start_col, patch_size, search_stride, roi,
+                                                    matching_patches);
+    return matching_patches.to_vectors();
+}
+
+template<typename MakeCosts>
+ViewMatches get_view_matches(const LightFieldView &grid,
+                             int i,
+                             int j,
+                             int patch_size,
+                             int num_similar,
+                             int search_stride,
+                             int roi,
+                             MakeCosts make_costs) {
+    /* Same search as get_matching_patches, for all the tiles of view (i, j) at once. The target views are visited
+       one at a time, and the SADs of every tile against that view are read from the cost source make_costs builds
+       for the pair (a CostVolume or IntegralCosts), so each shift is computed once for the whole view instead of
+       once per tile. Every tile moves its window to each better candidate as it goes, so the candidates are taken
+       one step of the window at a time for all the tiles, sorted by shift so that the tiles asking for the same
+       shift follow each other. The chained prev_position of every tile is kept across the views of each direction,
+       so the directions are independent and each one runs as a separate OpenMP task. The matches are only inserted
+       once all of them are done, in the same order as get_matching_patches, so the result is identical. The state of
+       the tiles is held in flat arrays, from the arena of the thread of each direction, so that the number of heap
+       allocations does not grow with the number of tiles. */
+    int tile_cols = (grid.width + patch_size - 1) / patch_size;
+    int num_tiles = ((grid.height + patch_size - 1) / patch_size) * tile_cols;
+    vector<vector<vector<int>>> directions = search_directions(grid, i, j);
+    // best match of every tile in every target view (in search order)
+    vector<size_t> first_view = {0};
+    for (const auto &direction: directions) {
+        first_view.push_back(first_view.back() + direction.size());
+    }
+    vector<Match> best(first_view.back() * num_tiles);
+
+    // the four directions do not depend on each other, so each one is a separate task
+    for (size_t d = 0; d < directions.size(); d++) {
+        #pragma omp task default(none) firstprivate(d) shared(grid, i, j, patch_size, search_stride, roi, make_costs, \
+                                                              tile_cols, num_tiles, directions, first_view, best)
+        {
+            ProfileScope scope(Phase::matching, i, j, (int) d);
+            const auto &direction = directions[d];
+            ScratchArena &arena = ScratchArena::local();
+            ScratchArena::Scope arena_scope(arena);
+            // the window of every tile, chained from one view to the next, and its best difference in the view
+            Match *current = arena.allocate<Match>(num_tiles);
+            for (int t = 0; t < num_tiles; t++) {
+                current[t] = {0, 0, t / tile_cols * patch_size, t % tile_cols * patch_size, 255};
+            }
+            // (shift, tile) of the candidates of one step of the window
+            pair<int, int> *step = arena.allocate<pair<int, int>>(num_tiles);
+            uint64_t candidates = 0;
+            for (size_t k = 0; k < direction.size(); k++) {
+                const auto &view = direction[k];
+                // views in the same column are searched along the rows, the others along the columns
+                int axis = view[1] == j ? 0 : 1;
+                int extent = axis == 0 ? grid.height : grid.width;
+                // the window of a tile drifts by at most roi * (roi + 1) / 2 strides in every view, which bounds the
+                // shifts this view can be asked for
+                size_t shifts = min(static_cast<size_t>(k + 1) * roi * (roi + 1) + 1,
+                                    static_cast<size_t>(2 * extent / search_stride + 1));
+                auto costs = make_costs(view[0], view[1], shifts);
+                for (int t = 0; t < num_tiles; t++) {
+                    current[t].difference = 255;
+                }
+                for (int a = -roi; a <= roi; a++) {
+                    int steps = 0;
+                    for (int t = 0; t < num_tiles; t++) {
+                        int start = axis == 0 ? t / tile_cols * patch_size : t % tile_cols * patch_size;
+                        int size = min(extent - start, patch_size);
+                        int pos = (axis == 0 ? current[t].row : current[t].col) + a * search_stride;
+                        if (pos >= 0 and pos + size <= extent) {
+                            step[steps++] = {pos - start, t};
+                        }
+                    }
+                    sort(step, step + steps);
+                    candidates += steps;
+                    for (int n = 0; n < steps; n++) {
+                        auto [shift, t] = step[n];
+                        int start_row = t / tile_cols * patch_size;
+                        int start_col = t % tile_cols * patch_size;
+                        int patchsize[2] = {min(grid.height - start_row, patch_size),
+                                            min(grid.width - start_col, patch_size)};
+                        int difference = (int) costs.cost(start_row, start_col, patchsize[0], patchsize[1], shift);
+                        difference /= grid.channels * patchsize[0] * patchsize[1];
+                        if (difference < current[t].difference) {
+                            current[t].difference = (uint8_t) difference;
+                            (axis == 0 ? current[t].row : current[t].col) = (axis == 0 ? start_row : start_col) + shift;
+                        }
+                    }
+                }
+                for (int t = 0; t < num_tiles; t++) {
+                    best[(first_view[d] + k) * num_tiles + t] = {view[0], view[1], current[t].row, current[t].col,
+                                                                 current[t].difference};
+                }
+            }
+            profile_count(Counter::candidates, candidates);
+        }
+    }
+    #pragma omp taskwait
+
+    ProfileScope scope(Phase::top_k, i, j);
+    profile_count(Counter::tiles_matched, num_tiles);
+    profile_count(Counter::top_k_inserts, num_tiles * first_view.back());
+    ViewMatches matching_patches(num_tiles, num_similar);
+    for (int t = 0; t < num_tiles; t++) {
+        TopMatches top(num_similar);
+        for (size_t v = 0; v < first_view.back(); v++) {
+            top.insert(best[v * num_tiles + t]);
+        }
+        matching_patches.assign(t, top);
     }
     return matching_patches;
 }
 
-vector<vector<vector<uint8_t>>> get_frankenpatches(vector<vector<vector<vector<vector<uint8_t>>>>> grid,
-                                                   int i,
-                                                   int j,
-                                                   int patch_size,
-                                                   int num_similar,
-                                                   int search_stride,
-                                                   int roi) {
-    vector<vector<vector<uint8_t>>> output = vector<vector<vector<uint8_t>>>(3 * num_similar + 3,
-                                                                             vector<vector<uint8_t>>(
-                                                                                     grid[i][j][0].size(),
-                                                                                     vector<uint8_t>(
-                                                                                             grid[i][j][0][0].size())));
-    for (int h = 0; h < grid[i][j][0].size(); h += patch_size) {
-        for (int w = 0; w < grid[i][j][0][0].size(); w += patch_size) {
-            vector<vector<int>> matching_patches = get_matching_patches(grid,
-                                                                        i,
-                                                                        j,
-                                                                        h,
-                                                                        w,
-                                                                        patch_size,
-                                                                        num_similar,
-                                                                        search_stride,
-                                                                        roi);
-            vector<int> patchsize = vector<int>(2, 0);
-            patchsize[0] = min((int) grid[i][j][0].size() - h, patch_size);
-            patchsize[1] = min((int) grid[i][j][0][0].size() - w, patch_size);
-
-            matching_patches.emplace_back(vector<int>{i, j, h, w});
-            while (matching_patches.size() < num_similar + 1) {
-                matching_patches.emplace_back(vector<int>{i, j, h, w});
+ViewMatches get_view_matches_patchmatch(const LightFieldView &grid,
+                                        int i,
+                                        int j,
+                                        int patch_size,
+                                        int num_similar,
+                                        int search_stride,
+                                        int roi,
+                                        int iterations) {
+    /* PatchMatch search for all the tiles of view (i, j). In every target view each tile keeps a current best shift
+       along the epipolar line, which starts at random within the distance the chained search can reach
+       (roi * search_stride per view of baseline). Every iteration then visits the tiles, alternating between
+       row-major and reverse order, and tries
+         - the shifts of the neighbouring tiles already visited in this pass (propagation across tiles),
+         - the shift of the same tile in the closer view of the same direction, scaled by the ratio of the
+           baselines (propagation across views),
+         - random shifts around the current best, halving the search radius each time.
+       The directions share nothing, so each one runs as a separate OpenMP task with its own random generator,
+       seeded from the view and the direction so that runs are reproducible whatever the number of threads. */
+    int tile_cols = (grid.width + patch_size - 1) / patch_size;
+    int num_tiles = ((grid.height + patch_size - 1) / patch_size) * tile_cols;
+
+    // target views in search order, with the index of the closer view of the same direction (-1 for the first),
+    // and the index of the first view of every direction
+    vector<vector<int>> views;
+    vector<size_t> first_view = {0};
+    for (const auto &direction: search_directions(grid, i, j)) {
+        for (size_t k = 0; k < direction.size(); k++) {
+            views.push_back({direction[k][0], direction[k][1], k == 0 ? -1 : (int) views.size() - 1});
+        }
+        first_view.push_back(views.size());
+    }
+
+    // current best shift of every tile in every target view, and its (raw) difference, in one flat array per view
+    vector<int> shifts(views.size() * num_tiles, 0);
+    vector<int> costs(views.size() * num_tiles, INT_MAX);
+    // shifts evaluated in every target view, each written by the task of its direction only
+    vector<uint64_t> candidates(views.size(), 0);
+    auto try_shift = [&](size_t v, int t, int shift) {
+        int axis = views[v][1] == j ? 0 : 1;
+        int extent = axis == 0 ? grid.height : grid.width;
+        int start_row = t / tile_cols * patch_size;
+        int start_col = t % tile_cols * patch_size;
+        int patchsize[2] = {min(grid.height - start_row, patch_size), min(grid.width - start_col, patch_size)};
+        int position[2] = {start_row, start_col};
+        position[axis] += shift;
+        if (position[axis] < 0 or position[axis] + patchsize[axis] > extent) {
+            return;
+        }
+        candidates[v]++;
+        int difference = patch_difference<0, 0, MatchMode::exhaustive>(grid, i, j, start_row, start_col,
+                                                                        views[v][0], views[v][1], position[0],
+                                                                        position[1], patchsize, 0);
+        if (difference < costs[v * num_tiles + t]) {
+            costs[v * num_tiles + t] = difference;
+            shifts[v * num_tiles + t] = shift;
+        }
+    };
+    auto baseline = [&](size_t v) {
+        return abs(views[v][0] - i) + abs(views[v][1] - j);
+    };
+
+    for (size_t d = 0; d + 1 < first_view.size(); d++) {
+        #pragma omp task default(none) firstprivate(d) \
+                shared(i, j, grid, search_stride, roi, iterations, num_tiles, tile_cols, views, first_view, shifts, \
+                       try_shift, baseline)
+        {
+            ProfileScope scope(Phase::matching, i, j, (int) d);
+            mt19937 generator((i * grid.grid_cols + j) * 4 + d);
+
+            // random initialisation, the tile itself being the fallback when the random shift falls outside of the view
+            for (size_t v = first_view[d]; v < first_view[d + 1]; v++) {
+                int reach = roi * search_stride * baseline(v);
+                uniform_int_distribution<int> distribution(-reach, reach);
+                for (int t = 0; t < num_tiles; t++) {
+                    try_shift(v, t, 0);
+                    try_shift(v, t, distribution(generator));
+                }
             }
 
-            // write the matching patches into output
-            for (int k = 0; k < matching_patches.size(); k++) {
-                for (int l = 0; l < patchsize[0]; l++) {
-                    for (int m = 0; m < patchsize[1]; m++) {
-                        output[k * 3 + 0][h + l][w + m] = grid[matching_patches[k][0]][matching_patches[k][1]][0][
-                                matching_patches[k][2] + l][matching_patches[k][3] + m];
-                        output[k * 3 + 1][h + l][w + m] = grid[matching_patches[k][0]][matching_patches[k][1]][1][
-                                matching_patches[k][2] + l][matching_patches[k][3] + m];
-                        output[k * 3 + 2][h + l][w + m] = grid[matching_patches[k][0]][matching_patches[k][1]][2][
-                                matching_patches[k][2] + l][matching_patches[k][3] + m];
+            for (int iteration = 0; iteration < iterations; iteration++) {
+                bool forward = iteration % 2 == 0;
+                for (size_t v = first_view[d]; v < first_view[d + 1]; v++) {
+                    int reach = roi * search_stride * baseline(v);
+                    const int *view_shifts = &shifts[v * num_tiles];
+                    for (int n = 0; n < num_tiles; n++) {
+                        int t = forward ? n : num_tiles - 1 - n;
+                        int tile_col = t % tile_cols;
+                        // propagation from the tiles on the left and above (right and below on the reverse passes)
+                        if (forward) {
+                            if (tile_col > 0) {
+                                try_shift(v, t, view_shifts[t - 1]);
+                            }
+                            if (t >= tile_cols) {
+                                try_shift(v, t, view_shifts[t - tile_cols]);
+                            }
+                        } else {
+                            if (tile_col < tile_cols - 1 and t + 1 < num_tiles) {
+                                try_shift(v, t, view_shifts[t + 1]);
+                            }
+                            if (t + tile_cols < num_tiles) {
+                                try_shift(v, t, view_shifts[t + tile_cols]);
+                            }
+                        }
+                        // propagation from the closer view, the disparity growing linearly with the baseline
+                        int closer = views[v][2];
+                        if (closer >= 0) {
+                            try_shift(v, t, (int) lround((double) shifts[closer * num_tiles + t] * baseline(v) /
+                                                         baseline(closer)));
+                        }
+                        // random search around the current best
+                        for (int radius = reach; radius >= 1; radius /= 2) {
+                            uniform_int_distribution<int> distribution(-radius, radius);
+                            try_shift(v, t, view_shifts[t] + distribution(generator));
+                        }
                     }
                 }
             }
         }
     }
+    #pragma omp taskwait
+
+    ProfileScope scope(Phase::top_k, i, j);
+    profile_count(Counter::candidates, accumulate(candidates.begin(), candidates.end(), (uint64_t) 0));
+    profile_count(Counter::tiles_matched, num_tiles);
+    profile_count(Counter::top_k_inserts, num_tiles * views.size());
+    ViewMatches matching_patches(num_tiles, num_similar);
+    for (int t = 0; t < num_tiles; t++) {
+        int start_row = t / tile_cols * patch_size;
+        int start_col = t % tile_cols * patch_size;
+        int num_values = grid.channels * min(grid.height - start_row, patch_size) *
+                         min(grid.width - start_col, patch_size);
+        TopMatches top(num_similar);
+        for (size_t v = 0; v < views.size(); v++) {
+            int position[2] = {start_row, start_col};
+            position[views[v][1] == j ? 0 : 1] += shifts[v * num_tiles + t];
+            top.insert({views[v][0], views[v][1], position[0], position[1],
+                        (uint8_t) min(costs[v * num_tiles + t] / num_values, 255)});
+        }
+        matching_patches.assign(t, top);
+    }
+    return matching_patches;
+}
+
+ViewMatches match_view(const LightFieldView &grid,
+                       int i,
+                       int j,
+                       int patch_size,
+                       int num_similar,
+                       int search_stride,
+                       int roi,
+                       MatchMode mode = MatchMode::exhaustive,
+                       int patchmatch_iterations = 4) {
+    // find the matches of every tile of view (i, j), in row-major tile order, either tile by tile or for the whole
+    // view at once
+    if (!match_mode_available(mode)) {
+        throw invalid_argument("the cost_volume mode is only built with the PATCHMATCH_COST_VOLUME option");
+    }
+    if (mode == MatchMode::cost_volume) {
+        return get_view_matches(grid, i, j, patch_size, num_similar, search_stride, roi,
+                                [&](int view_row, int view_col, size_t shifts) {
+                                    return CostVolume(grid, i, j, view_row, view_col, patch_size, shifts);
+                                });
+    }
+    if (mode == MatchMode::integral) {
+        return get_view_matches(grid, i, j, patch_size, num_similar, search_stride, roi,
+                                [&](int view_row, int view_col, size_t shifts) {
+                                    return IntegralCosts(grid, i, j, view_row, view_col, shifts);
+                                });
+    }
+    if (mode == MatchMode::patchmatch) {
+        return get_view_matches_patchmatch(grid, i, j, patch_size, num_similar, search_stride, roi,
+                                           patchmatch_iterations);
+    }
+    int tile_rows = (grid.height + patch_size - 1) / patch_size;
+    int tile_cols = (grid.width + patch_size - 1) / patch_size;
+    ViewMatches view_matches(tile_rows * tile_cols, num_similar);
+    matcher_fn matcher = select_matcher(patch_size, grid.channels, mode);
+    // one task per row of tiles, so that the threads left idle by the views that finish early pick up the rows of
+    // the others
+    #pragma omp taskloop default(none) grainsize(1) \
+            shared(grid, i, j, patch_size, num_similar, search_stride, roi, tile_cols, view_matches, matcher)
+    for (int tile_row = 0; tile_row < tile_rows; tile_row++) {
+        ProfileScope scope(Phase::matching, i, j, tile_row);
+        profile_count(Counter::tiles_matched, tile_cols);
+        for (int tile_col = 0; tile_col < tile_cols; tile_col++) {
+            TopMatches matching_patches(num_similar);
+            matcher(grid, i, j, tile_row * patch_size, tile_col * patch_size, patch_size, search_stride, roi,
+                    matching_patches);
+            view_matches.assign(tile_row * tile_cols + tile_col, matching_patches);
+        }
+    }
+    return view_matches;
+}
+
+void copy_patches(const LightFieldView &grid,
+                  const Match *patches,
+                  int num_patches,
+                  int h,
+                  int w,
+                  int rows,
+                  int cols,
+                  Frankenpatches &output) {
+    // write the rows x cols patches into output, at the tile with top-left corner (h, w), one output row at a time so
+    // the writes are contiguous
+    ScratchArena &arena = ScratchArena::local();
+    ScratchArena::Scope scope(arena);
+    const uint8_t **sources = arena.allocate<const uint8_t *>(output.channels);
+    for (int l = 0; l < rows; l++) {
+        for (int k = 0; k < num_patches; k++) {
+            for (int c = 0; c < 3; c++) {
+                sources[k * 3 + c] = grid.row(patches[k].view_row, patches[k].view_col, c, patches[k].row + l) +
+                                     patches[k].col;
+            }
+        }
+        uint8_t *destination = output.pixels + (static_cast<size_t>(h + l) * output.width + w) * output.channels;
+        for (int m = 0; m < cols; m++) {
+            for (int s = 0; s < output.channels; s++) {
+                destination[m * output.channels + s] = sources[s][m];
+            }
+        }
+    }
+}
+
+void tile_patches(const ViewMatches &view_matches, size_t tile, int num_similar, const Match &self, Match *patches) {
+    // the num_similar + 1 patches a tile of the frankenpatches is made of: its matches, padded with the tile itself
+    // when there were fewer than num_similar, and the tile itself last
+    for (int k = 0; k < num_similar; k++) {
+        patches[k] = k < view_matches.size(tile) ? view_matches.at(tile, k) : self;
+    }
+    patches[num_similar] = self;
+}
+
+Frankenpatches assemble_frankenpatches(const LightFieldView &grid,
+                                       int i,
+                                       int j,
+                                       int patch_size,
+                                       int num_similar,
+                                       const ViewMatches &view_matches,
+                                       const string &filename = "") {
+    // with a filename, the output is assembled straight into that .npy file
+    Frankenpatches output = filename.empty() ? Frankenpatches(grid.height, grid.width, 3 * num_similar + 3) :
+                            Frankenpatches(grid.height, grid.width, 3 * num_similar + 3, filename);
+    int tile_cols = (grid.width + patch_size - 1) / patch_size;
+    // every row of tiles writes its own rows of the output
+    #pragma omp taskloop default(none) grainsize(1) \
+            shared(grid, i, j, patch_size, num_similar, tile_cols, view_matches, output)
+    for (int h = 0; h < grid.height; h += patch_size) {
+        ProfileScope profile(Phase::assembly, i, j, h / patch_size);
+        for (int w = 0; w < grid.width; w += patch_size) {
+            ScratchArena &arena = ScratchArena::local();
+            ScratchArena::Scope scope(arena);
+            Match *patches = arena.allocate<Match>(num_similar + 1);
+            tile_patches(view_matches, h / patch_size * tile_cols + w / patch_size, num_similar, {i, j, h, w, 0},
+                         patches);
+            copy_patches(grid, patches, num_similar + 1, h, w, min(grid.height - h, patch_size),
+                         min(grid.width - w, patch_size), output);
+        }
+    }
     return output;
 }
 
-void save_data(vector<vector<vector<uint8_t>>> data, const string &filename) {
-    vector<uint8_t> flat_data = vector<uint8_t>(data.size() * data[0].size() * data[0][0].size());
-    for (int i = 0; i < data[0].size(); i++) {
-        for (int j = 0; j < data[0][0].size(); j++) {
-            for (int k = 0; k < data.size(); k++) {
-                flat_data[i * data[0][0].size() * data.size() + j * data.size() + k] = data[k][i][j];
+MatchTable make_match_table(const LightFieldView &grid,
+                            int i,
+                            int j,
+                            int patch_size,
+                            int num_similar,
+                            const ViewMatches &view_matches) {
+    MatchTable table = MatchTable(grid.height, grid.width, patch_size, num_similar + 1);
+    #pragma omp taskloop default(none) grainsize(1) shared(grid, i, j, patch_size, num_similar, view_matches, table)
+    for (int tile_row = 0; tile_row < table.tile_rows; tile_row++) {
+        ProfileScope profile(Phase::flatten, i, j, tile_row);
+        for (int tile_col = 0; tile_col < table.tile_cols; tile_col++) {
+            int h = tile_row * patch_size;
+            int w = tile_col * patch_size;
+            int patchsize[2] = {min(grid.height - h, patch_size), min(grid.width - w, patch_size)};
+            int num_values = grid.channels * patchsize[0] * patchsize[1];
+            ScratchArena &arena = ScratchArena::local();
+            ScratchArena::Scope scope(arena);
+            Match *patches = arena.allocate<Match>(table.matches);
+            tile_patches(view_matches, tile_row * table.tile_cols + tile_col, num_similar, {i, j, h, w, 0}, patches);
+            for (int k = 0; k < table.matches; k++) {
+                const Match &match = patches[k];
+                uint16_t *entry = table.entry(tile_row, tile_col, k);
+                entry[0] = (uint16_t) match.view_row;
+                entry[1] = (uint16_t) match.view_col;
+                entry[2] = (uint16_t) match.row;
+                entry[3] = (uint16_t) match.col;
+                entry[4] = (uint16_t) (patch_difference<0, 0, MatchMode::exhaustive>(
+                        grid, i, j, h, w, match.view_row, match.view_col, match.row, match.col, patchsize, 0) /
+                                       num_values);
             }
         }
     }
+    return table;
+}
+
+void check_tile(const LightFieldView &grid, const MatchTable &table, int tile_row, int tile_col) {
+    // the patches of a tile of the table must lie in the grid before reconstruct_tile copies them
+    int rows = min(table.height - tile_row * table.patch_size, table.patch_size);
+    int cols = min(table.width - tile_col * table.patch_size, table.patch_size);
+    for (int k = 0; k < table.matches; k++) {
+        const uint16_t *entry = table.entry(tile_row, tile_col, k);
+        if (entry[0] >= grid.grid_rows or entry[1] >= grid.grid_cols or entry[2] + rows > grid.height or
+            entry[3] + cols > grid.width) {
+            throw invalid_argument("the match table refers to patches outside of the grid");
+        }
+    }
+}
+
+void reconstruct_tile(const LightFieldView &grid,
+                      const MatchTable &table,
+                      int tile_row,
+                      int tile_col,
+                      Frankenpatches &output) {
+    // materialize a single tile of the frankenpatches, at its place in output
+    int h = tile_row * table.patch_size;
+    int w = tile_col * table.patch_size;
+    ScratchArena &arena = ScratchArena::local();
+    ScratchArena::Scope scope(arena);
+    Match *patches = arena.allocate<Match>(table.matches);
+    for (int k = 0; k < table.matches; k++) {
+        const uint16_t *entry = table.entry(tile_row, tile_col, k);
+        patches[k] = {entry[0], entry[1], entry[2], entry[3], 0};
+    }
+    copy_patches(grid, patches, table.matches, h, w, min(table.height - h, table.patch_size),
+                 min(table.width - w, table.patch_size), output);
+}
 
-    cnpy::npy_save(filename,
-                   &flat_data[0],
-                   {static_cast<unsigned long>(data[0].size()),
-                    static_cast<unsigned long>(data[0][0].size()),
-                    static_cast<unsigned long>(data.size())},
-                   "w");
+Frankenpatches reconstruct_frankenpatches(const LightFieldView &grid, const MatchTable &table) {
+    // same output as assemble_frankenpatches, from the match table alone
+    if (table.height != grid.height or table.width != grid.width) {
+        throw invalid_argument("the match table is of a view of another size");
+    }
+    // every patch the table refers to must lie in the grid, as the tiles are copied without any further check
+    for (int tile_row = 0; tile_row < table.tile_rows; tile_row++) {
+        for (int tile_col = 0; tile_col < table.tile_cols; tile_col++) {
+            check_tile(grid, table, tile_row, tile_col);
+        }
+    }
+    Frankenpatches output = Frankenpatches(table.height, table.width, 3 * table.matches);
+    #pragma omp taskloop default(none) grainsize(1) shared(grid, table, output)
+    for (int tile_row = 0; tile_row < table.tile_rows; tile_row++) {
+        for (int tile_col = 0; tile_col < table.tile_cols; tile_col++) {
+            reconstruct_tile(grid, table, tile_row, tile_col, output);
+        }
+    }
+    return output;
+}
+
+Frankenpatches get_frankenpatches(const LightFieldView &grid,
+                                  int i,
+                                  int j,
+                                  int patch_size,
+                                  int num_similar,
+                                  int search_stride,
+                                  int roi,
+                                  MatchMode mode = MatchMode::exhaustive,
+                                  int patchmatch_iterations = 4) {
+    return assemble_frankenpatches(grid, i, j, patch_size, num_similar,
+                                   match_view(grid, i, j, patch_size, num_similar, search_stride, roi, mode,
+                                              patchmatch_iterations));
+}
+
+void compare_matches(const LightFieldView &grid,
+                     int i,
+                     int j,
+                     int patch_size,
+                     const ViewMatches &view_matches,
+                     const ViewMatches &exhaustive_matches,
+                     MatchQuality &quality) {
+    auto difference = [&](int h, int w, const int *patchsize, const Match &match) {
+        return patch_difference<0, 0, MatchMode::exhaustive>(grid, i, j, h, w, match.view_row, match.view_col,
+                                                             match.row, match.col, patchsize, 0) /
+               (grid.channels * patchsize[0] * patchsize[1]);
+    };
+    int tile = 0;
+    for (int h = 0; h < grid.height; h += patch_size) {
+        for (int w = 0; w < grid.width; w += patch_size) {
+            int patchsize[2] = {min(grid.height - h, patch_size), min(grid.width - w, patch_size)};
+            for (int k = 0; k < view_matches.size(tile); k++) {
+                const Match &match = view_matches.at(tile, k);
+                quality.difference += difference(h, w, patchsize, match);
+                for (int e = 0; e < exhaustive_matches.size(tile); e++) {
+                    const Match &exhaustive = exhaustive_matches.at(tile, e);
+                    if (exhaustive.view_row == match.view_row and exhaustive.view_col == match.view_col and
+                        exhaustive.row == match.row and exhaustive.col == match.col) {
+                        quality.identical++;
+                        break;
+                    }
+                }
+                quality.matches++;
+            }
+            for (int k = 0; k < exhaustive_matches.size(tile); k++) {
+                quality.exhaustive_difference += difference(h, w, patchsize, exhaustive_matches.at(tile, k));
+            }
+            tile++;
+        }
+    }
+}
+
+void save_data(const Frankenpatches &data, const string &filename) {
+    cnpy::npy_save(filename, data.pixels, data.shape(), "w");
+}
+
+void save_data(Frankenpatches &&data, const string &filename, AsyncWriter &writer) {
+    // same as above, but the buffer (which must be held in memory) is handed over to the writer thread instead of
+    // being written by the caller
+    writer.submit(filename, move(data.data), data.shape());
+}
+
+// zlib level of the npz output: the fastest one, since the frankenpatches are written at least as fast as they are
+// compressed
+constexpr int output_compression_level = 1;
+
+vector<cnpy::NpzMember> compress_data(const Frankenpatches &data, int chunk_rows) {
+    /* Split the frankenpatches into bands of chunk_rows rows, each deflated as its own .npz member named
+       rows_<first row>, so that a reader only inflates the band holding the tile it wants. The bands are compressed
+       by parallel OpenMP tasks. */
+    int num_chunks = (data.height + chunk_rows - 1) / chunk_rows;
+    vector<cnpy::NpzMember> members(num_chunks);
+    size_t row_bytes = static_cast<size_t>(data.width) * data.channels;
+    #pragma omp taskloop default(none) grainsize(1) shared(data, chunk_rows, num_chunks, members, row_bytes)
+    for (int chunk = 0; chunk < num_chunks; chunk++) {
+        ProfileScope scope(Phase::flatten, -1, -1, chunk);
+        int first_row = chunk * chunk_rows;
+        int rows = min(chunk_rows, data.height - first_row);
+        members[chunk] = cnpy::npz_deflate("rows_" + to_string(first_row), data.pixels + first_row * row_bytes,
+                                           {static_cast<size_t>(rows), static_cast<size_t>(data.width),
+                                            static_cast<size_t>(data.channels)},
+                                           output_compression_level);
+    }
+    return members;
+}
+
+void save_compressed(const Frankenpatches &data, const string &filename, int chunk_rows, AsyncWriter &writer) {
+    // the compression is done by the calling thread (and its tasks), only the write is queued
+    writer.submit(filename, compress_data(data, chunk_rows));
+}
+
+void save_match_table(const MatchTable &table, const string &filename, AsyncWriter &writer) {
+    // the table and the geometry needed to cut the view back into tiles, as the two members of an .npz archive
+    vector<uint32_t> geometry = {(uint32_t) table.height, (uint32_t) table.width, (uint32_t) table.patch_size};
+    vector<size_t> shape = {static_cast<size_t>(table.tile_rows), static_cast<size_t>(table.tile_cols),
+                            static_cast<size_t>(table.matches), MatchTable::fields};
+    writer.submit(filename, {cnpy::npz_deflate("matches", table.entries.data(), shape, output_compression_level),
+                             cnpy::npz_deflate("geometry", geometry.data(), {geometry.size()},
+                                               output_compression_level)});
+}
+
+MatchTable load_match_table(const string &filename) {
+    // the archive is checked against what save_match_table writes before anything is read out of it
+    cnpy::NpyArray geometry = cnpy::npz_load(filename, "geometry");
+    cnpy::NpyArray matches = cnpy::npz_load(filename, "matches");
+    if (geometry.type != 'u' or geometry.word_size != sizeof(uint32_t) or geometry.shape != vector<size_t>{3}) {
+        throw runtime_error("the geometry of " + filename + " is not 3 uint32 values");
+    }
+    if (matches.type != 'u' or matches.word_size != sizeof(uint16_t) or matches.fortran_order or
+        matches.shape.size() != 4 or matches.shape[3] != MatchTable::fields) {
+        throw runtime_error("the match table of " + filename + " is not a uint16 array of " +
+                            to_string(MatchTable::fields) + " fields per match");
+    }
+    const uint32_t *values = geometry.data<uint32_t>();
+    if (values[2] == 0 or values[0] > UINT16_MAX or values[1] > UINT16_MAX or matches.shape[2] == 0 or
+        matches.shape[2] > static_cast<size_t>(max_similar) + 1) {
+        throw runtime_error("the geometry of " + filename + " is out of range");
+    }
+    MatchTable table = MatchTable((int) values[0], (int) values[1], (int) values[2], (int) matches.shape[2]);
+    if (matches.shape[0] != static_cast<size_t>(table.tile_rows) or
+        matches.shape[1] != static_cast<size_t>(table.tile_cols)) {
+        throw runtime_error("the match table of " + filename + " does not match its geometry");
+    }
+    copy(matches.data<uint16_t>(), matches.data<uint16_t>() + matches.num_vals, table.entries.begin());
+    return table;
 }
@@ -0,0 +1,195 @@
+//
+// Bounded set of resident views of a light field, for grids that do not fit in memory.
+//
+
+#ifndef VIEW_CACHE_H
+#define VIEW_CACHE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "lightfield.h"
+
+class ViewCache {
+    /* Keeps at most max_bytes worth of views of a grid_rows x grid_cols light field in memory, each view with its
+       coarser copies, for a schedule of reference views known in advance. Before step k of the schedule the row and
+       the column of the k-th reference view, which is everything its search reads, are made resident. The views
+       that have to go make room for them are the ones whose next use in the schedule is the furthest away (Belady's
+       rule, optimal here since the whole schedule is known), so a larger budget directly means fewer decodes.
+       grid() exposes the resident views as a LightFieldView, in which the views that are not resident are null. */
+public:
+    ViewCache(int grid_rows,
+              int grid_cols,
+              int height,
+              int width,
+              int pyramid_levels,
+              std::vector<std::vector<int>> schedule,
+              size_t max_bytes) :
+            grid_rows(grid_rows), grid_cols(grid_cols), schedule(std::move(schedule)),
+            owner(grid_rows * grid_cols, -1), uses(grid_rows * grid_cols), loads(0) {
+        LightField slot = LightField(1, 1, 3, height, width);
+        for (int level = 0; level < pyramid_levels; level++) {
+            height = (height + 1) / 2;
+            width = (width + 1) / 2;
+            slot.pyramid.emplace_back(1, 1, 3, height, width);
+        }
+        size_t slot_bytes = slot.data.size();
+        for (const auto &level: slot.pyramid) {
+            slot_bytes += level.data.size();
+        }
+        // a reference view needs its whole row and column at once
+        size_t capacity = std::min<size_t>(max_bytes / slot_bytes, grid_rows * grid_cols);
+        if (capacity < static_cast<size_t>(grid_rows + grid_cols - 1)) {
+            throw std::invalid_argument("the memory cap holds " + std::to_string(capacity) + " views, at least " +
+                                        std::to_string(grid_rows + grid_cols - 1) + " are needed");
+        }
+        slots.assign(capacity, slot);
+        resident.assign(capacity, -1);
+
+        // the steps at which every view is read, in increasing order
+        for (size_t step = 0; step < this->schedule.size(); step++) {
+            for (int v: needed(step)) {
+                uses[v].push_back(step);
+            }
+        }
+
+        // shape and strides of a single view, for the whole grid
+        grid_view = LightFieldView(slot);
+        grid_view.grid_rows = grid_rows;
+        grid_view.grid_cols = grid_cols;
+        grid_view.views.assign(grid_rows * grid_cols, nullptr);
+        for (auto &level: grid_view.pyramid) {
+            level.grid_rows = grid_rows;
+            level.grid_cols = grid_cols;
+            level.views.assign(grid_rows * grid_cols, nullptr);
+        }
+    }
+
+    static std::vector<std::vector<int>> serpentine_schedule(int grid_rows, int grid_cols) {
+        // row by row, alternating the direction, so that the columns read at the end of a row are still resident at
+        // the start of the next one
+        std::vector<std::vector<int>> schedule;
+        for (int i = 0; i < grid_rows; i++) {
+            for (int k = 0; k < grid_cols; k++) {
+                schedule.push_back({i, i % 2 == 0 ? k : grid_cols - 1 - k});
+            }
+        }
+        return schedule;
+    }
+
+    template<typename Load>
+    void advance(size_t step, Load load) {
+        /* Make the views read at `step` resident, decoding the missing ones with load(slot, view_row, view_col),
+           which must fill the 1x1 LightField `slot` and its pyramid. The loads run as OpenMP tasks, so they are
+           parallel when this is called from inside a parallel region. */
+        std::vector<int> current = needed(step);
+        std::vector<bool> wanted(grid_rows * grid_cols, false);
+        for (int v: current) {
+            wanted[v] = true;
+        }
+        std::vector<std::vector<int>> missing;
+        for (int v: current) {
+            if (owner[v] >= 0) {
+                continue;
+            }
+            // free slot if there is one, otherwise the one whose view is needed again the latest (or never)
+            int victim = -1;
+            for (size_t s = 0; s < slots.size() and victim < 0; s++) {
+                if (resident[s] < 0) {
+                    victim = (int) s;
+                }
+            }
+            if (victim < 0) {
+                size_t latest = 0;
+                for (size_t s = 0; s < slots.size(); s++) {
+                    if (wanted[resident[s]]) {
+                        continue;
+                    }
+                    auto next = std::lower_bound(uses[resident[s]].begin(), uses[resident[s]].end(), step);
+                    size_t next_use = next == uses[resident[s]].end() ? schedule.size() : *next;
+                    if (victim < 0 or next_use > latest) {
+                        latest = next_use;
+                        victim = (int) s;
+                    }
+                }
+                evict(victim);
+            }
+            resident[victim] = v;
+            owner[v] = victim;
+            missing.push_back({v, victim});
+        }
+
+        #pragma omp taskloop grainsize(1) shared(missing, load)
+        for (size_t k = 0; k < missing.size(); k++) {
+            load(slots[missing[k][1]], missing[k][0] / grid_cols, missing[k][0] % grid_cols);
+        }
+        for (const auto &entry: missing) {
+            grid_view.views[entry[0]] = slots[entry[1]].data.data();
+            for (size_t level = 0; level < grid_view.pyramid.size(); level++) {
+                grid_view.pyramid[level].views[entry[0]] = slots[entry[1]].pyramid[level].data.data();
+            }
+        }
+        loads += missing.size();
+    }
+
+    const LightFieldView &grid() const {
+        return grid_view;
+    }
+
+    const std::vector<int> &reference(size_t step) const {
+        return schedule[step];
+    }
+
+    size_t steps() const {
+        return schedule.size();
+    }
+
+    // number of views decoded so far
+    size_t decoded() const {
+        return loads;
+    }
+
+private:
+    std::vector<int> needed(size_t step) const {
+        // row and column of the reference view of `step`, as indices into the grid
+        std::vector<int> views;
+        int i = schedule[step][0];
+        int j = schedule[step][1];
+        for (int c = 0; c < grid_cols; c++) {
+            views.push_back(i * grid_cols + c);
+        }
+        for (int r = 0; r < grid_rows; r++) {
+            if (r != i) {
+                views.push_back(r * grid_cols + j);
+            }
+        }
+        return views;
+    }
+
+    void evict(int slot) {
+        int v = resident[slot];
+        owner[v] = -1;
+        grid_view.views[v] = nullptr;
+        for (auto &level: grid_view.pyramid) {
+            level.views[v] = nullptr;
+        }
+        resident[slot] = -1;
+    }
+
+    int grid_rows;
+    int grid_cols;
+    std::vector<std::vector<int>> schedule;
+    // storage of the resident views, and the view each slot holds (-1 when free)
+    std::vector<LightField> slots;
+    std::vector<int> resident;
+    // slot holding every view of the grid (-1 when not resident)
+    std::vector<int> owner;
+    // steps of the schedule at which every view is read
+    std::vector<std::vector<size_t>> uses;
+    LightFieldView grid_view;
+    size_t loads;
+};
+
+#endif //VIEW_CACHE_H